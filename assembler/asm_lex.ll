@@ -124,6 +124,7 @@ assign		        return ASSIGN;
 {DOT}word               return DOT_WORD;
 {DOT}string             return DOT_STRING;
 {DOT}define             return DOT_DEFINE;
+{DOT}global             return DOT_GLOBAL;
 
 {ID}                    {
                             yylval.str = new std::string(yytext);
@@ -7,34 +7,35 @@
 
 int main()
 {
-    labels_map labels;
+    Arena ir;
+    SymbolTable symbols(ir);
 
-    ExprInt::sptr id5(new ExprInt(12));
-    ExprIdent::sptr id(new ExprIdent("foo"));
-    ExprIdent::sptr id2(new ExprIdent("fib"));
-    ExprIdent::sptr id3(new ExprIdent("blarg"));
-    ExprIdent::sptr id4(new ExprIdent("boo"));
-    ExprIdent::sptr id6(new ExprIdent("feeb"));
-    labels["feeb"] = LineNumberExpr(id5, 0);
-    labels["boo"] = LineNumberExpr(id3, 0);
-    labels["blarg"] = LineNumberExpr(id4, 31415);
-    labels["able"] = LineNumberExpr(id3, 12345);
+    ExprInt *id5 = ir.New<ExprInt>(12);
+    ExprIdent *id2 = ir.New<ExprIdent>(symbols.Intern("fib"));
+    ExprIdent *id3 = ir.New<ExprIdent>(symbols.Intern("blarg"));
+    ExprIdent *id4 = ir.New<ExprIdent>(symbols.Intern("boo"));
+    ExprIdent *id6 = ir.New<ExprIdent>(symbols.Intern("feeb"));
+    symbols.Intern("feeb")->Define(id5, 0);
+    symbols.Intern("boo")->Define(id3, 0);
+    symbols.Intern("blarg")->Define(id4, 31415);
+    symbols.Intern("able")->Define(id3, 12345);
+    symbols.Resolve();
     uint v;
     bool r;
     
-    r = id4->eval(labels, 4545, &v);
+    r = EvaluateAbsolute(id4, 4545, &v);
     if(!r)
         printf("id4 failed\n");
     else
         printf("id4 = %d\n", v);
 
-    r = id2->eval(labels, 666, &v);
+    r = EvaluateAbsolute(id2, 666, &v);
     if(!r)
         printf("id2 failed\n");
     else
         printf("id2 = %d\n", v);
 
-    r = id6->eval(labels, 999, &v);
+    r = EvaluateAbsolute(id6, 999, &v);
     if(!r)
         printf("failed\n");
     else
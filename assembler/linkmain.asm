@@ -0,0 +1,21 @@
+// Main module of the two-object link sample; see linksub.asm.
+// "make linktest" links the two objects and checks the BIN matches
+// assembling both files concatenated as one source.
+.global reset
+.org 0
+        jmp reset
+
+reset:  assign r1, table        // .hi/.lo of a label in linksub
+        load.word r2, r1
+        jsr r5, subr            // relative branch into linksub
+        moviu r4, counter.hi
+        addiu r4, counter.lo
+        cmp r0, r2
+        jne done
+        jl reset
+        jmp far
+done:   hlt
+
+local:  .word local, done, table // table is imported
+        .short 7
+        .byte 3
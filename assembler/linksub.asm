@@ -0,0 +1,17 @@
+// Second module of the two-object link sample; see linkmain.asm.
+.global subr
+.global table
+.global counter
+.global far
+.define alias reset             // imported label, re-exported
+.define k 0x55                  // absolute value export
+
+subr:   addi r0, 1
+        jmp alias
+far:    jne subr
+        jl done2
+done2:  hlt
+
+table:  .word subr, counter, alias, k
+counter: .word 0
+        .byte 1, 2, 3
@@ -0,0 +1,221 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <stdio.h>
+
+#include "parsing.h"
+
+// Links object files from "asm -o" into one image.  Objects are placed one
+// after another from address 0, each at a multiple of 4, in the order
+// given; their .global symbols are shared, and every relocation is
+// finished once all the objects have addresses.
+
+struct ObjectFile
+{
+    std::string name;
+    std::vector<unsigned char> contents;
+    const object::header *header;
+    const object::symbol *symbols;
+    const object::relocation *relocations;
+    const char *names;
+    std::vector<std::pair<const object::extent*, const unsigned char*> > extents;
+    uint base;
+    uint64_t size;      // up to the end of the last extent
+    bool Read(const char *filename);
+    const char *Name(uint32_t symbol) const { return names + symbols[symbol].name; }
+};
+
+bool ObjectFile::Read(const char *filename)
+{
+    name = filename;
+    FILE *fp = fopen(filename, "rb");
+    if(fp == NULL) {
+        std::cerr << "failed to open " << filename << " for input " << std::endl;
+        return false;
+    }
+    unsigned char block[64 * 1024];
+    size_t n;
+    while((n = fread(block, 1, sizeof(block), fp)) > 0)
+        contents.insert(contents.end(), block, block + n);
+    fclose(fp);
+
+    size_t offset = 0;
+    auto take = [&](uint64_t bytes) -> const unsigned char * {
+        if(bytes > contents.size() - offset)
+            return NULL;
+        const unsigned char *p = contents.data() + offset;
+        offset += (bytes + 3) & ~uint64_t(3);
+        offset = std::min(offset, contents.size());
+        return p;
+    };
+
+    header = (const object::header *)take(sizeof(object::header));
+    if(header == NULL || memcmp(header->magic, object::MAGIC, sizeof(header->magic)) != 0) {
+        std::cerr << filename << " is not an object file" << std::endl;
+        return false;
+    }
+    symbols = (const object::symbol *)take(uint64_t(header->symbols) * sizeof(object::symbol));
+    relocations = (const object::relocation *)take(uint64_t(header->relocations) * sizeof(object::relocation));
+    names = (const char *)take(header->names);
+    bool valid = symbols != NULL && relocations != NULL && names != NULL &&
+        (header->names == 0 || names[header->names - 1] == '\0');
+    for(uint32_t i = 0; valid && i < header->symbols; i++)
+        valid = symbols[i].name < header->names;
+    for(uint32_t i = 0; valid && i < header->relocations; i++)
+        valid = (relocations[i].symbol < header->symbols || relocations[i].symbol == object::ORIGIN) &&
+            relocations[i].kind <= Relocation::DATA32 && relocations[i].part <= Term::LO;
+
+    size = 0;
+    for(uint32_t i = 0; valid && i < header->extents; i++) {
+        const object::extent *e = (const object::extent *)take(sizeof(object::extent));
+        const unsigned char *bytes = (e == NULL) ? NULL : take(e->size);
+        valid = bytes != NULL;
+        if(valid) {
+            extents.push_back(std::make_pair(e, bytes));
+            size = std::max(size, uint64_t(e->address) + e->size);
+        }
+    }
+    for(uint32_t i = 0; valid && i < header->relocations; i++) {
+        const object::relocation& r = relocations[i];
+        int bytes = (r.kind == Relocation::DATA8) ? 1 : (r.kind == Relocation::DATA16) ? 2 : 4;
+        valid = uint64_t(r.address) + bytes <= size; // patches must land inside the object
+    }
+    if(!valid)
+        std::cerr << filename << " is truncated or corrupt" << std::endl;
+    return valid;
+}
+
+void usage(const char *progname)
+{
+    std::cerr << "usage: " << progname << " [-b BINoutputfile] [-m MIFoutputfile] [-s SEGMENTEDoutputfile] objectfile..." << std::endl;
+    std::cerr << "if no output files are given, this program will " << std::endl;
+    std::cerr << "write a BIN file to stdout" << std::endl;
+}
+
+int main( int argc, char **argv )
+{
+    const char *progname = argv[0];
+    const char *BINfilename = NULL;
+    const char *MIFfilename = NULL;
+    const char *SEGMENTEDfilename = NULL;
+    argc--; argv++;
+
+    while(argc > 0 && argv[0][0] == '-') {
+        const char **filename = NULL;
+        if(strcmp(argv[0], "-b") == 0)
+            filename = &BINfilename;
+        else if(strcmp(argv[0], "-m") == 0)
+            filename = &MIFfilename;
+        else if(strcmp(argv[0], "-s") == 0)
+            filename = &SEGMENTEDfilename;
+        if(filename == NULL || argc < 2) {
+            std::cerr << argv[0] << " requires a filename parameter" << std::endl;
+            usage(progname);
+            exit(EXIT_FAILURE);
+        }
+        *filename = argv[1];
+        argc -= 2; argv += 2;
+    }
+
+    if(argc < 1) {
+        std::cerr << "Expected at least one object file" << std::endl;
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    Arena ir;
+    SymbolTable symbols(ir);
+    std::vector<ObjectFile> objects(argc);
+    std::unordered_map<Symbol*, int> definer; // object defining each symbol
+    bool success = true;
+
+    uint64_t address = 0;
+    for(int i = 0; i < argc; i++) {
+        ObjectFile& obj = objects[i];
+        if(!obj.Read(argv[i]))
+            exit(EXIT_FAILURE);
+        obj.base = address;
+        address = (address + obj.size + 3) & ~uint64_t(3);
+        if(address > 0x100000000ull) {
+            std::cerr << "objects don't fit in 4 GiB from " << obj.name << " on" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        for(uint32_t j = 0; j < obj.header->symbols; j++) {
+            const object::symbol& entry = obj.symbols[j];
+            if(!(entry.flags & object::DEFINED))
+                continue;
+            Symbol *sym = symbols.Intern(obj.Name(j), strlen(obj.Name(j)));
+            if(sym->expr != NULL) {
+                std::cerr << "symbol \"" << sym->name << "\" is defined in both " << objects[definer[sym]].name << " and " << obj.name << std::endl;
+                success = false;
+                continue;
+            }
+            uint value = (entry.flags & object::RELATIVE) ? obj.base + entry.value : entry.value;
+            sym->Define(ir.New<ExprInt>(value), 0);
+            definer[sym] = i;
+        }
+    }
+    symbols.Resolve();
+
+    OutputFile file;
+    for(auto obj = objects.begin(); obj != objects.end(); obj++) {
+        for(auto it = obj->extents.begin(); it != obj->extents.end(); it++) {
+            unsigned char *p = file.Reserve(obj->base + it->first->address, it->first->size);
+            memcpy(p, it->second, it->first->size);
+        }
+    }
+
+    for(auto obj = objects.begin(); obj != objects.end(); obj++) {
+        for(uint32_t j = 0; j < obj->header->relocations; j++) {
+            const object::relocation& r = obj->relocations[j];
+            Term t = {NULL, r.offset, Term::Part(r.part)};
+            if(r.symbol == object::ORIGIN) {
+                t.offset += obj->base;
+            } else {
+                Symbol *sym = symbols.Intern(obj->Name(r.symbol), strlen(obj->Name(r.symbol)));
+                if(sym->expr == NULL) {
+                    std::cerr << "undefined symbol \"" << sym->name << "\" at line " << r.linenum << " of " << obj->name << std::endl;
+                    success = false;
+                    continue;
+                }
+                t.offset += sym->value.offset;
+            }
+            uint v = t.Select(t.offset);
+
+            uint at = obj->base + r.address;
+            int bytes = (r.kind == Relocation::DATA8) ? 1 : (r.kind == Relocation::DATA16) ? 2 : 4;
+            unsigned char *p = file.Reserve(at, bytes);
+            if(r.kind == Relocation::IMMEDIATE) {
+                uint word = p[0] | (p[1] << 8) | (p[2] << 16) | (uint(p[3]) << 24);
+                uint opcode = word >> 27;
+                v = word | instr_infos[opcode].Encode(v, r.linenum, at);
+            }
+            for(int i = 0; i < bytes; i++)
+                p[i] = (v >> i * 8) & 0xff;
+        }
+    }
+
+    if(!success)
+        exit(EXIT_FAILURE);
+
+    if(BINfilename == NULL && MIFfilename == NULL && SEGMENTEDfilename == NULL) {
+        file.FinishBIN(stdout);
+        exit(EXIT_SUCCESS);
+    }
+
+    const char *filenames[] = {BINfilename, MIFfilename, SEGMENTEDfilename};
+    void (OutputFile::*writers[])(FILE *) = {&OutputFile::FinishBIN, &OutputFile::FinishMIF, &OutputFile::FinishSegments};
+    for(int i = 0; i < 3; i++) {
+        if(filenames[i] == NULL)
+            continue;
+        FILE *output = fopen(filenames[i], "wb");
+        if(output == NULL) {
+            std::cerr << "failed to open " << filenames[i] << " for output " << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        (file.*writers[i])(output);
+        fclose(output);
+    }
+}
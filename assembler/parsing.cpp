@@ -1,56 +1,273 @@
 #include <iostream>
+#include <algorithm>
 #include "parsing.h"
 
-bool ExprBitwiseAnd::eval(labels_map& labels, uint linenum, uint *value)
+void Arena::Grow(size_t size)
 {
-    uint l, r;
-    bool result1 = left->eval(labels, linenum, &l);
-    bool result2 = right->eval(labels, linenum, &r);
-    *value = l & r;
+    size_t bytes = std::max(size, size_t(BLOCK_SIZE));
+    char *block = (char *)malloc(bytes);
+    if(block == NULL) {
+        std::cerr << "out of memory allocating " << bytes << " bytes for expressions" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    blocks.push_back(block);
+    next = block;
+    end = block + bytes;
+}
+
+void Arena::Release()
+{
+    for(auto it = blocks.begin(); it != blocks.end(); it++)
+        free(*it);
+    blocks.clear();
+    next = end = NULL;
+}
+
+Symbol *SymbolTable::Intern(const char *name, size_t length)
+{
+    // FNV-1a
+    uint hash = 2166136261u;
+    for(size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    size_t mask = slots.size() - 1;
+    for(size_t i = hash & mask; ; i = (i + 1) & mask) {
+        Symbol *sym = slots[i];
+        if(sym == NULL)
+            break;
+        if(sym->hash == hash && strncmp(sym->name, name, length) == 0 && sym->name[length] == '\0')
+            return sym;
+    }
+
+    char *copy = (char *)arena.Allocate(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    Symbol *sym = arena.New<Symbol>(copy, hash);
+    symbols.push_back(sym);
+
+    if(symbols.size() * 2 > slots.size())
+        Grow();
+    else {
+        size_t i = hash & mask;
+        while(slots[i] != NULL)
+            i = (i + 1) & mask;
+        slots[i] = sym;
+    }
+    return sym;
+}
+
+void SymbolTable::Grow()
+{
+    slots.assign(slots.size() * 2, NULL);
+    size_t mask = slots.size() - 1;
+    for(auto it = symbols.begin(); it != symbols.end(); it++) {
+        size_t i = (*it)->hash & mask;
+        while(slots[i] != NULL)
+            i = (i + 1) & mask;
+        slots[i] = *it;
+    }
+}
+
+void SymbolTable::Clear()
+{
+    slots.assign(slots.size(), NULL);
+    symbols.clear();
+}
+
+// Evaluate every defined symbol after the symbols its expression names,
+// using an explicit stack so long .define chains can't overflow the C
+// stack.  A reference back to a symbol still on the stack is a cycle;
+// the whole chain is reported and every symbol in it evaluates to 0.
+bool SymbolTable::Resolve()
+{
+    struct Frame
+    {
+        Symbol *sym;
+        size_t first;   // this symbol's dependencies are deps[first..]
+        size_t next;
+    };
+    std::vector<Frame> stack;
+    std::vector<Symbol*> deps;
+    bool success = true;
+
+    auto push = [&](Symbol *sym) {
+        sym->state = Symbol::RESOLVING;
+        Frame frame = {sym, deps.size(), deps.size()};
+        stack.push_back(frame);
+        sym->expr->depends(deps);
+    };
+
+    for(auto it = symbols.begin(); it != symbols.end(); it++) {
+        if((*it)->state != Symbol::UNRESOLVED || (*it)->expr == NULL)
+            continue;
+
+        push(*it);
+        while(!stack.empty()) {
+            Frame& frame = stack.back();
+
+            if(frame.next < deps.size()) {
+                Symbol *dep = deps[frame.next++];
+                if(dep->state == Symbol::UNRESOLVED && dep->expr != NULL) {
+                    push(dep);
+                } else if(dep->state == Symbol::RESOLVING) {
+                    size_t start = stack.size() - 1;
+                    while(stack[start].sym != dep)
+                        start--;
+                    std::cerr << "circular definition ";
+                    for(size_t i = start; i < stack.size(); i++) {
+                        std::cerr << "\"" << stack[i].sym->name << "\" (line " << stack[i].sym->linenum << ") -> ";
+                        stack[i].sym->state = Symbol::FAILED;
+                    }
+                    std::cerr << "\"" << dep->name << "\" will evaluate to 0" << std::endl;
+                    success = false;
+                }
+                continue;
+            }
+
+            Symbol *sym = frame.sym;
+            deps.resize(frame.first);
+            stack.pop_back();
+            if(sym->state == Symbol::RESOLVING && sym->expr->eval(sym->linenum, &sym->value))
+                sym->state = Symbol::RESOLVED;
+            else {
+                sym->state = Symbol::FAILED;
+                Term zero = {NULL, 0, Term::WHOLE};
+                sym->value = zero;
+                success = false;
+            }
+        }
+    }
+    return success;
+}
+
+static bool Relocatable(uint linenum, Term *value)
+{
+    std::cerr << "expression at line " << linenum << " can't be relocated and will evaluate to 0" << std::endl;
+    Term zero = {NULL, 0, Term::WHOLE};
+    *value = zero;
+    return false;
+}
+
+// Only "& 0xffff" and, under it, ">> 16" are kept for a relocatable
+// value, which is all .hi and .lo need
+bool ExprBitwiseAnd::eval(uint linenum, Term *value)
+{
+    Term l, r;
+    bool result1 = left->eval(linenum, &l);
+    bool result2 = right->eval(linenum, &r);
+    if(l.base == NULL && r.base == NULL) {
+        Term t = {NULL, l.offset & r.offset, Term::WHOLE};
+        *value = t;
+    } else if(r.base == NULL && r.offset == 0xffff) {
+        *value = l;
+        if(l.part == Term::WHOLE)
+            value->part = Term::LO;
+    } else {
+        return Relocatable(linenum, value);
+    }
     return result1 && result2;
 }
 
-bool ExprShift::eval(labels_map& labels, uint linenum, uint *value)
+bool ExprShift::eval(uint linenum, Term *value)
 {
-    uint o, s;
-    bool result1 = operand->eval(labels, linenum, &o);
-    bool result2 = shift->eval(labels, linenum, &s);
-    if(shift > 0)
-        *value = o >> s;
-    else
-        *value = o << s;
+    Term o, s;
+    bool result1 = operand->eval(linenum, &o);
+    bool result2 = shift->eval(linenum, &s);
+    if(s.base != NULL)
+        return Relocatable(linenum, value);
+    int count = s.offset;
+    if(o.base == NULL) {
+        // negative shift counts shift right, as .hi uses
+        Term t = {NULL, (count < 0) ? (o.offset >> -count) : (o.offset << count), Term::WHOLE};
+        *value = t;
+    } else if(o.part == Term::WHOLE && count == -16) {
+        *value = o;
+        value->part = Term::HI;
+    } else {
+        return Relocatable(linenum, value);
+    }
     return result1 && result2;
 }
 
-bool ExprInt::eval(labels_map& labels, uint linenum, uint *value)
+bool ExprInt::eval(uint linenum, Term *value)
 {
-    *value = u;
+    Term t = {NULL, u, Term::WHOLE};
+    *value = t;
     return true;
 }
 
-bool ExprIdent::eval(labels_map& labels, uint linenum, uint *value)
+bool ExprOffset::eval(uint linenum, Term *value)
 {
-    if(visited) {
-        std::cerr << "circular reference to identifier \"" << s << "\" at line " << linenum << " will evaluate to 0" << std::endl;
+    Term t = {base, offset, Term::WHOLE};
+    *value = t;
+    return true;
+}
+
+// Only valid after SymbolTable::Resolve().  An undefined symbol is left
+// as the base for whoever stores the value to import or report.
+bool ExprIdent::eval(uint linenum, Term *value)
+{
+    if(sym->expr == NULL) {
+        Term t = {sym, 0, Term::WHOLE};
+        *value = t;
+        return true;
+    }
+
+    *value = sym->value;
+    return sym->state == Symbol::RESOLVED;
+}
+
+static void Unresolved(const Term& t, uint linenum)
+{
+    if(t.base->expr == NULL)
+        std::cerr << "unresolved identifier \"" << t.base->name << "\" in expression at line " << linenum << " will evaluate to 0" << std::endl;
+    else
+        std::cerr << "expression at line " << linenum << " needs a linker and will evaluate to 0" << std::endl;
+}
+
+bool EvaluateAbsolute(ExprBase *expr, uint linenum, uint *value)
+{
+    Term t;
+    bool success = expr->eval(linenum, &t);
+    if(t.base != NULL) {
+        Unresolved(t, linenum);
         *value = 0;
         return false;
     }
+    *value = t.offset;
+    return success;
+}
 
-    visited = true;
+// Gives the bits to store for an immediate operand or a data item.  In an
+// object file, a value that still has a base is stored as zero and left
+// to the linker through a Relocation.
+static bool Finish(OutputFile& file, ExprBase *expr, uint linenum, uint address, Relocation::Kind kind, uint opcode, uint *bits)
+{
+    Term t;
+    bool success = expr->eval(linenum, &t);
+
+    // a PC-relative reference within the object moves with it
+    if(kind == Relocation::IMMEDIATE && instr_infos[opcode].relative && t.base != NULL && t.base == file.origin && t.part == Term::WHOLE)
+        t.base = NULL;
+
+    if(t.base != NULL && file.origin != NULL) {
+        Relocation r = {address, linenum, kind, t};
+        file.relocations.push_back(r);
+        *bits = 0;
+        return success;
+    }
 
-    auto unres = labels.find(s);
-    if(unres != labels.end()) {
-        ExprBase::sptr expr(unres->second.first);
-        uint linenum = unres->second.second;
-        bool result = expr->eval(labels, linenum, value);
-        visited = false;
-        return result;
+    if(t.base != NULL) {
+        Unresolved(t, linenum);
+        t.offset = 0;
+        success = false;
     }
 
-    std::cerr << "unresolved identifier \"" << s << "\" in expression at line " << linenum << " will evaluate to 0" << std::endl;
-    *value = 0;
-    visited = false;
-    return false;
+    if(kind == Relocation::IMMEDIATE)
+        *bits = instr_infos[opcode].Encode(t.offset, linenum, address);
+    else
+        *bits = t.offset;
+    return success;
 }
 
 uint ImmediateOperandInfo::Encode(uint v, int line, uint address)
@@ -130,101 +347,93 @@ ImmediateOperandInfo instr_infos[] = {
 };
 
 
-bool InstructionDirect::Store(labels_map& labels, OutputFile& file)
+bool InstructionDirect::Store(OutputFile& file)
 {
     uint instruction = simple_cpu_2014::format27(opcode, 0);
     file.Store32(address, instruction);
     return true;
 }
 
-bool InstructionRXRY::Store(labels_map& labels, OutputFile& file)
+bool InstructionRXRY::Store(OutputFile& file)
 {
     uint instruction = simple_cpu_2014::format18(opcode, rx, ry, 0, 0);
     file.Store32(address, instruction);
     return true;
 }
 
-bool InstructionRX::Store(labels_map& labels, OutputFile& file)
+bool InstructionRX::Store(OutputFile& file)
 {
     uint instruction = simple_cpu_2014::format24(opcode, rx, 0);
     file.Store32(address, instruction);
     return true;
 }
 
-bool InstructionImm::Store(labels_map& labels, OutputFile& file)
+bool InstructionImm::Store(OutputFile& file)
 {
     unsigned int u;
-    bool success = imm->eval(labels, linenum, &u);
-
-    u = instr_infos[opcode].Encode(u, linenum, address);
+    bool success = Finish(file, imm, linenum, address, Relocation::IMMEDIATE, opcode, &u);
 
     uint instruction = simple_cpu_2014::format27(opcode, u);
     file.Store32(address, instruction);
     return success;
 }
 
-bool InstructionRXImm::Store(labels_map& labels, OutputFile& file)
+bool InstructionRXImm::Store(OutputFile& file)
 {
     unsigned int u;
-    bool success = imm->eval(labels, linenum, &u);
-
-    u = instr_infos[opcode].Encode(u, linenum, address);
+    bool success = Finish(file, imm, linenum, address, Relocation::IMMEDIATE, opcode, &u);
 
     uint instruction = simple_cpu_2014::format24(opcode, rx, u);
     file.Store32(address, instruction);
     return success;
 }
 
-bool InstructionRXImmModified::Store(labels_map& labels, OutputFile& file)
+bool InstructionRXImmModified::Store(OutputFile& file)
 {
     unsigned int u;
-    bool success = imm->eval(labels, linenum, &u);
-
-    u = instr_infos[opcode].Encode(u, linenum, address);
+    bool success = Finish(file, imm, linenum, address, Relocation::IMMEDIATE, opcode, &u);
 
     uint instruction = simple_cpu_2014::format18(opcode, rx, 0, modifier, u);
     file.Store32(address, instruction);
     return success;
 }
 
-bool InstructionRXRYImmModified::Store(labels_map& labels, OutputFile& file)
+bool InstructionRXRYImmModified::Store(OutputFile& file)
 {
     unsigned int u;
-    bool success = imm->eval(labels, linenum, &u);
-
-    u = instr_infos[opcode].Encode(u, linenum, address);
+    bool success = Finish(file, imm, linenum, address, Relocation::IMMEDIATE, opcode, &u);
 
     uint instruction = simple_cpu_2014::format18(opcode, rx, ry, modifier, u);
     file.Store32(address, instruction);
     return success;
 }
 
-bool StoreInstructions(labels_map& labels, OutputFile& file, std::vector<Instruction::sptr>& instrs)
+bool StoreInstructions(OutputFile& file, std::vector<Instruction*>& instrs)
 {
     for(auto it = instrs.begin(); it != instrs.end(); it++) {
-        bool result = (*it)->Store(labels, file); 
+        bool result = (*it)->Store(file); 
         if(!result)
             return false;
     }
     return true;
 }
 
-bool StoreMemoryDirectives(labels_map& labels, OutputFile& file, std::vector<Store>& stores)
+bool StoreMemoryDirectives(OutputFile& file, std::vector<Store>& stores)
 {
     bool success = true;
     for(auto it = stores.begin(); it != stores.end(); it++) {
         Store& store = *it;
-        unsigned int address = store.address;
+        // the whole directive is one run of bytes, so reserve it at once
+        unsigned char *p = file.Reserve(store.address, store.size * store.exprs.size());
+        uint address = store.address;
+        Relocation::Kind kind = (store.size == 1) ? Relocation::DATA8 : (store.size == 2) ? Relocation::DATA16 : Relocation::DATA32;
         for(auto m = store.exprs.begin(); m != store.exprs.end(); m++) {
             unsigned int u;
-            bool result = (*m)->eval(labels, store.linenum, &u);
+            bool result = Finish(file, *m, store.linenum, address, kind, 0, &u);
             // XXX check size of item
-            if(store.size == 1)
-                file.Store8(address, u);
-            else if(store.size == 2)
-                file.Store16(address, u);
-            else if(store.size == 4)
-                file.Store32(address, u);
+            for(int i = 0; i < store.size; i++)
+                p[i] = (u >> i * 8) & 0xff;
+            p += store.size;
             address += store.size;
             success = success && result;
         }
@@ -232,18 +441,280 @@ bool StoreMemoryDirectives(labels_map& labels, OutputFile& file, std::vector<Sto
     return success;
 }
 
+// Returns room for size bytes at address, growing or creating an extent
+// and absorbing any later extents the new bytes reach
+unsigned char *OutputFile::Reserve(uint address, uint size)
+{
+    // stores mostly run upward, so try the previous extent first
+    if(last >= extents.size() || address < extents[last].address || address > extents[last].end()) {
+        Extent key;
+        key.address = address;
+        auto it = std::upper_bound(extents.begin(), extents.end(), key,
+            [](const Extent& a, const Extent& b) { return a.address < b.address; });
+        if(it != extents.begin() && address <= (it - 1)->end()) {
+            last = it - 1 - extents.begin();
+        } else {
+            it = extents.insert(it, key);
+            last = it - extents.begin();
+        }
+    }
+
+    Extent& e = extents[last];
+    uint64_t end = uint64_t(address) + size;
+    if(end > e.end()) {
+        e.bytes.resize(end - e.address);
+        while(last + 1 < extents.size() && extents[last + 1].address <= e.end()) {
+            Extent& next = extents[last + 1];
+            if(next.end() > e.end())
+                e.bytes.resize(next.end() - e.address);
+            std::copy(next.bytes.begin(), next.bytes.end(), e.bytes.begin() + (next.address - e.address));
+            extents.erase(extents.begin() + last + 1);
+        }
+    }
+    return &e.bytes[address - e.address];
+}
+
+// Copies size bytes of the image starting at address, zero where nothing
+// was stored
+void OutputFile::Read(uint64_t address, unsigned char *dst, size_t size)
+{
+    memset(dst, 0, size);
+    uint64_t end = address + size;
+    Extent key;
+    key.address = address;
+    auto it = std::upper_bound(extents.begin(), extents.end(), key,
+        [](const Extent& a, const Extent& b) { return a.address < b.address; });
+    if(it != extents.begin())
+        it--;
+    for(; it != extents.end() && it->address < end; it++) {
+        uint64_t from = std::max(address, uint64_t(it->address));
+        uint64_t to = std::min(end, it->end());
+        if(from < to)
+            memcpy(dst + (from - address), &it->bytes[from - it->address], to - from);
+    }
+}
+
+// Writers stream the image through this much memory at a time
+static const size_t window_size = 64 * 1024;
+
+static void WriteZeros(FILE *fp, uint64_t count)
+{
+    static const unsigned char zeros[window_size] = {0};
+    for(; count > 0; count -= std::min(count, uint64_t(window_size)))
+        fwrite(zeros, 1, std::min(count, uint64_t(window_size)), fp);
+}
+
+// Extents are written straight from where they are held
+void OutputFile::FinishBIN(FILE *fp)
+{
+    uint64_t written = 0;
+    for(auto it = extents.begin(); it != extents.end(); it++) {
+        WriteZeros(fp, it->address - written);
+        fwrite(it->bytes.data(), 1, it->bytes.size(), fp);
+        written = it->end();
+    }
+    WriteZeros(fp, ((written + 3) & ~uint64_t(3)) - written);
+}
+
+// Eight hex digits of v, most significant first, formatted in parallel
+// in a 64-bit register rather than a digit at a time.  Assumes a
+// little-endian host, as the image does.
+static inline void FormatHex32(char *dst, uint v)
+{
+    uint64_t x = v;
+    // spread the nibbles one to a byte, most significant in the lowest
+    x = ((x & 0x0000ffffull) << 32) | ((x & 0xffff0000ull) >> 16);
+    x = ((x & 0x000000ff000000ffull) << 16) | ((x & 0x0000ff000000ff00ull) >> 8);
+    x = ((x & 0x000f000f000f000full) << 8) | ((x & 0x00f000f000f000f0ull) >> 4);
+    // bytes holding 10..15 get a carry into bit 4, and 'A' - '9' - 1 more
+    uint64_t letters = ((x + 0x0606060606060606ull) >> 4) & 0x0101010101010101ull;
+    x += 0x3030303030303030ull + letters * 7;
+    memcpy(dst, &x, 8);
+}
+
+// MIF addresses are at least four digits, as "%04X" gives
+static inline char *FormatAddress(char *dst, uint64_t address)
+{
+    char digits[8];
+    FormatHex32(digits, address);
+    int n = 8;
+    while(n > 4 && digits[8 - n] == '0')
+        n--;
+    memcpy(dst, digits + 8 - n, n);
+    return dst + n;
+}
+
+// Lines are built in a large buffer and written in blocks; a run of
+// identical words becomes one "[first..last] : value;" line
 void OutputFile::FinishMIF(FILE *fp)
 {
-    uint words = (max + 3) / 4;
+    uint64_t words = (End() + 3) / 4;
     fprintf(fp, "-- Written from asm, Assembler for Jim's Simple CPU 2014\n");
-    fprintf(fp, "DEPTH = %d;\n", words);
+    fprintf(fp, "DEPTH = %llu;\n", (unsigned long long)words);
     fprintf(fp, "WIDTH = 32;\n");
     fprintf(fp, "ADDRESS_RADIX = HEX;\n");
     fprintf(fp, "DATA_RADIX = HEX;\n");
     fprintf(fp, "CONTENT\n");
     fprintf(fp, "BEGIN\n");
-    for(uint i = 0; i < words; i++)
-        fprintf(fp, "%04X : %08X;\n", i, *(uint*)(buffer + i*4));
+
+    const size_t longest_line = 32; // "[XXXXXXXX..XXXXXXXX] : XXXXXXXX;\n"
+    std::vector<char> text(256 * 1024);
+    char *out = &text[0];
+    char *limit = &text[0] + text.size() - longest_line;
+
+    std::vector<unsigned char> window(window_size);
+    uint64_t first = 0;
+    uint value = 0;
+    for(uint64_t i = 0; i <= words; i++) {
+        uint v = 0;
+        if(i < words) {
+            size_t offset = (i * 4) % window_size;
+            if(offset == 0)
+                Read(i * 4, &window[0], std::min(uint64_t(window_size), (words - i) * 4));
+            memcpy(&v, &window[offset], 4);
+            if(i == 0)
+                value = v;
+        }
+        if(i > first && (i == words || v != value)) {
+            if(i - first == 1) {
+                out = FormatAddress(out, first);
+            } else {
+                *out++ = '[';
+                out = FormatAddress(out, first);
+                *out++ = '.';
+                *out++ = '.';
+                out = FormatAddress(out, i - 1);
+                *out++ = ']';
+            }
+            memcpy(out, " : ", 3);
+            FormatHex32(out + 3, value);
+            memcpy(out + 11, ";\n", 2);
+            out += 13;
+            if(out >= limit) {
+                fwrite(&text[0], 1, out - &text[0], fp);
+                out = &text[0];
+            }
+            first = i;
+            value = v;
+        }
+    }
+    fwrite(&text[0], 1, out - &text[0], fp);
     fprintf(fp, "END\n");
 }
 
+// Extents are widened to segment::ALIGN and those that then touch share a
+// segment, so the simulator can map each one directly
+void OutputFile::FinishSegments(FILE *fp)
+{
+    using namespace simple_cpu_2014;
+    const uint64_t align = segment::ALIGN;
+
+    std::vector<segment::entry> entries;
+    for(auto it = extents.begin(); it != extents.end(); it++) {
+        uint64_t start = it->address & ~(align - 1);
+        uint64_t end = (it->end() + align - 1) & ~(align - 1);
+        if(!entries.empty() && start <= uint64_t(entries.back().address) + entries.back().size) {
+            entries.back().size = end - entries.back().address;
+        } else {
+            segment::entry e = {uint32_t(start), uint32_t(end - start), 0};
+            entries.push_back(e);
+        }
+    }
+
+    segment::header h;
+    memcpy(h.magic, segment::MAGIC, sizeof(h.magic));
+    h.count = entries.size();
+    h.reserved = 0;
+
+    uint64_t offset = (sizeof(h) + entries.size() * sizeof(segment::entry) + align - 1) & ~(align - 1);
+    for(auto it = entries.begin(); it != entries.end(); it++) {
+        it->offset = offset;
+        offset += it->size;
+    }
+
+    std::vector<unsigned char> window(window_size);
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(entries.data(), sizeof(segment::entry), entries.size(), fp);
+    uint64_t written = sizeof(h) + entries.size() * sizeof(segment::entry);
+    if(!entries.empty()) {
+        memset(&window[0], 0, entries[0].offset - written);
+        fwrite(&window[0], 1, entries[0].offset - written, fp);
+    }
+    for(auto it = entries.begin(); it != entries.end(); it++) {
+        for(uint64_t done = 0; done < it->size; done += window_size) {
+            size_t n = std::min(uint64_t(window_size), it->size - done);
+            Read(it->address + done, &window[0], n);
+            fwrite(&window[0], 1, n, fp);
+        }
+    }
+}
+
+// Exported symbols must be constants or offsets from the origin; any
+// other symbol a relocation names is listed as an import
+bool WriteObject(FILE *fp, OutputFile& file, SymbolTable& symbols)
+{
+    std::vector<object::symbol> table;
+    std::vector<object::relocation> relocations;
+    std::string names;
+    std::map<Symbol*, uint32_t> index;
+    bool success = true;
+
+    for(auto it = symbols.symbols.begin(); it != symbols.symbols.end(); it++) {
+        Symbol *sym = *it;
+        if(sym->global && sym->expr == NULL) {
+            std::cerr << "global symbol \"" << sym->name << "\" is never defined" << std::endl;
+            success = false;
+            continue;
+        }
+        if(!sym->global || sym->state != Symbol::RESOLVED)
+            continue;
+        object::symbol entry = {uint32_t(names.size()), sym->value.offset, object::DEFINED};
+        if(sym->value.base == symbols.origin && sym->value.part == Term::WHOLE) {
+            entry.flags |= object::RELATIVE;
+        } else if(sym->value.base != NULL) {
+            std::cerr << "global symbol \"" << sym->name << "\" at line " << sym->linenum << " depends on \"" << sym->value.base->name << "\" and can't be exported" << std::endl;
+            success = false;
+            continue;
+        }
+        names.append(sym->name, strlen(sym->name) + 1);
+        index[sym] = table.size();
+        table.push_back(entry);
+    }
+
+    for(auto it = file.relocations.begin(); it != file.relocations.end(); it++) {
+        object::relocation r = {it->address, it->linenum, uint16_t(it->kind), uint16_t(it->value.part), object::ORIGIN, it->value.offset};
+        Symbol *base = it->value.base;
+        if(base != symbols.origin) {
+            auto found = index.find(base);
+            if(found == index.end()) {
+                object::symbol entry = {uint32_t(names.size()), 0, 0};
+                names.append(base->name, strlen(base->name) + 1);
+                found = index.insert(std::make_pair(base, uint32_t(table.size()))).first;
+                table.push_back(entry);
+            }
+            r.symbol = found->second;
+        }
+        relocations.push_back(r);
+    }
+
+    object::header h;
+    memcpy(h.magic, object::MAGIC, sizeof(h.magic));
+    h.symbols = table.size();
+    h.relocations = relocations.size();
+    h.names = names.size();
+    h.extents = file.extents.size();
+
+    static const unsigned char zeros[4] = {0};
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(table.data(), sizeof(object::symbol), table.size(), fp);
+    fwrite(relocations.data(), sizeof(object::relocation), relocations.size(), fp);
+    fwrite(names.data(), 1, names.size(), fp);
+    fwrite(zeros, 1, (4 - names.size() % 4) % 4, fp);
+    for(auto it = file.extents.begin(); it != file.extents.end(); it++) {
+        object::extent e = {it->address, uint32_t(it->bytes.size())};
+        fwrite(&e, sizeof(e), 1, fp);
+        fwrite(it->bytes.data(), 1, it->bytes.size(), fp);
+        fwrite(zeros, 1, (4 - it->bytes.size() % 4) % 4, fp);
+    }
+    return success;
+}
@@ -2,58 +2,171 @@
 #include <vector>
 #include <string>
 #include <cstring>
-#include <memory>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <stdint.h>
+#include <new>
+#include <utility>
 
 #include "simple_cpu_2014.hpp"
 
 typedef unsigned int uint;
 
+// Bump allocator for the expression and instruction IR.  Nodes are
+// never freed individually; Release() drops every block at once at the
+// end of the pass, so nodes must not own anything needing a destructor.
+struct Arena
+{
+    static const size_t BLOCK_SIZE = 256 * 1024;
+    std::vector<char*> blocks;
+    char *next;
+    char *end;
+    Arena() :
+        next(NULL),
+        end(NULL)
+    {}
+    ~Arena() { Release(); }
+    void *Allocate(size_t size)
+    {
+        const size_t align = alignof(std::max_align_t);
+        size = (size + align - 1) & ~(align - 1);
+        if(size > size_t(end - next))
+            Grow(size);
+        void *p = next;
+        next += size;
+        return p;
+    }
+    template <class T, class... Args>
+    T *New(Args&&... args)
+    {
+        return new(Allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+    void Grow(size_t size);
+    void Release();
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
 struct ExprBase;
+struct Symbol;
 
-typedef std::pair<std::shared_ptr<ExprBase>, uint> LineNumberExpr;
-typedef std::map<std::string, LineNumberExpr> labels_map;
+// A value as far as the assembler can know it: the final address of base,
+// or 0 if base is NULL, plus offset, then all of that or the half .hi or
+// .lo takes.  Only in an object file does a Term keep a base, which the
+// linker fills in through a Relocation.
+struct Term
+{
+    enum Part { WHOLE, HI, LO };
+    Symbol *base;
+    uint offset;
+    Part part;
+    uint Select(uint v) const { return (part == HI) ? (v >> 16) : (part == LO) ? (v & 0xffff) : v; }
+};
 
-bool ResolveExpression(const std::string& str, uint linenum, labels_map& labels, uint *value);
+// A label or .define name.  Names are interned, so every reference to
+// the same name shares one Symbol and ExprIdent can point straight at it.
+// SymbolTable::Resolve() evaluates each definition once, dependencies
+// first, and caches the result in value.
+struct Symbol
+{
+    enum State { UNRESOLVED, RESOLVING, RESOLVED, FAILED };
+    const char *name;
+    uint hash;
+    ExprBase *expr;     // NULL if never defined
+    uint linenum;
+    Term value;
+    State state;
+    bool global;        // named by .global, so exported from an object file
+    Symbol(const char *name_, uint hash_) :
+        name(name_),
+        hash(hash_),
+        expr(NULL),
+        linenum(0),
+        state(UNRESOLVED),
+        global(false)
+    {
+        Term zero = {NULL, 0, Term::WHOLE};
+        value = zero;
+    }
+    void Define(ExprBase *expr_, uint linenum_)
+    {
+        expr = expr_;
+        linenum = linenum_;
+    }
+};
+
+// Open-addressed hash table of Symbols allocated from an Arena
+struct SymbolTable
+{
+    Arena& arena;
+    std::vector<Symbol*> slots;         // power of two, NULL if empty
+    std::vector<Symbol*> symbols;       // in order of first appearance
+    Symbol *origin;     // address 0 of an object file, wherever it is linked
+    SymbolTable(Arena& arena_) :
+        arena(arena_),
+        slots(1024, NULL),
+        origin(arena_.New<Symbol>("", 0))
+    {}
+    Symbol *Intern(const char *name, size_t length);
+    Symbol *Intern(const std::string& name) { return Intern(name.data(), name.size()); }
+    bool Resolve();
+    void Clear();
+private:
+    void Grow();
+};
 
 struct ExprBase
 {
-    typedef std::shared_ptr<ExprBase> sptr;
-    virtual bool eval(labels_map& labels, uint linenum, uint *value) = 0;
+    virtual bool eval(uint linenum, Term *value) = 0;
+    virtual void depends(std::vector<Symbol*>& syms) = 0;
     virtual ~ExprBase() {}
 };
 
 struct ExprInt : public ExprBase
 {
-    typedef std::shared_ptr<ExprInt> sptr;
     uint u;
-    virtual bool eval(labels_map& labels, uint linenum, uint *value);
+    virtual bool eval(uint linenum, Term *value);
+    virtual void depends(std::vector<Symbol*>& syms) {}
     ExprInt(uint u_) :
         u(u_)
         {}
     virtual ~ExprInt() {}
 };
 
+// Labels in an object file are offsets from its origin
+struct ExprOffset : public ExprBase
+{
+    Symbol *base;
+    uint offset;
+    virtual bool eval(uint linenum, Term *value);
+    virtual void depends(std::vector<Symbol*>& syms) {}
+    ExprOffset(Symbol *base_, uint offset_) :
+        base(base_),
+        offset(offset_)
+        {}
+    virtual ~ExprOffset() {}
+};
+
 struct ExprIdent : public ExprBase
 {
-    typedef std::shared_ptr<ExprIdent> sptr;
-    std::string s;
-    virtual bool eval(labels_map& labels, uint linenum, uint *value);
-    ExprIdent(const std::string &s_) :
-        s(s_),
-        visited(false)
+    Symbol *sym;
+    virtual bool eval(uint linenum, Term *value);
+    virtual void depends(std::vector<Symbol*>& syms) { syms.push_back(sym); }
+    ExprIdent(Symbol *sym_) :
+        sym(sym_)
         {}
     virtual ~ExprIdent() {}
-private:
-    bool visited;
 };
 
 struct ExprBitwiseAnd : public ExprBase
 {
-    typedef std::shared_ptr<ExprBitwiseAnd> sptr;
-    ExprBase::sptr left;
-    ExprBase::sptr right;
-    virtual bool eval(labels_map& labels, uint linenum, uint *value);
-    ExprBitwiseAnd(const ExprBase::sptr& l_, const ExprBase::sptr& r_) :
+    ExprBase *left;
+    ExprBase *right;
+    virtual bool eval(uint linenum, Term *value);
+    virtual void depends(std::vector<Symbol*>& syms) { left->depends(syms); right->depends(syms); }
+    ExprBitwiseAnd(ExprBase* l_, ExprBase* r_) :
         left(l_),
         right(r_)
         {}
@@ -62,74 +175,97 @@ struct ExprBitwiseAnd : public ExprBase
 
 struct ExprShift : public ExprBase
 {
-    typedef std::shared_ptr<ExprShift> sptr;
-    ExprBase::sptr operand;
-    ExprBase::sptr shift;
-    virtual bool eval(labels_map& labels, uint linenum, uint *value);
-    ExprShift(const ExprBase::sptr& operand_, const ExprBase::sptr& shift_) :
+    ExprBase *operand;
+    ExprBase *shift;
+    virtual bool eval(uint linenum, Term *value);
+    virtual void depends(std::vector<Symbol*>& syms) { operand->depends(syms); shift->depends(syms); }
+    ExprShift(ExprBase* operand_, ExprBase* shift_) :
         operand(operand_),
         shift(shift_)
         {}
     virtual ~ExprShift() {}
 };
 
-typedef std::vector<ExprBase::sptr> ExprList;
+typedef std::vector<ExprBase*> ExprList;
+
+// The value of an expression that needs no relocation; a symbol it still
+// depends on is reported and the expression evaluates to 0
+bool EvaluateAbsolute(ExprBase *expr, uint linenum, uint *value);
 
-// labels_map labels;
-//
 // when encountering .define:
-// labels[identifier] = LineNumberExpr(expr, curLine);
+// symbols.Intern(identifier)->Define(expr, curLine);
 //
 // when padding and storing label:
-// labels[identifier] = LineNumberExpr(ExprInt(address), curLine);
+// symbols.Intern(identifier)->Define(ExprInt(address), curLine);
 //
 // when creating instruction:
 // store expression
-// then, later, when resolving instruction,
-// bool success = expr->eval(labels, v);
+// then, once the whole file is read,
+// symbols.Resolve();
+// bool success = EvaluateAbsolute(expr, linenum, &v);
+
+// Asks the linker to finish the bits stored at address once it has placed
+// the value's base: an instruction's immediate field, encoded as
+// instr_infos[] gives for its opcode, or a .byte, .short or .word item
+struct Relocation
+{
+    enum Kind { IMMEDIATE, DATA8, DATA16, DATA32 };
+    uint address;
+    uint linenum;
+    Kind kind;
+    Term value;
+};
 
+// Sparse image: the bytes stored so far as a sorted list of extents that
+// neither overlap nor touch, so only what the program occupies is held.
+// Bytes never stored read as zero.
 struct OutputFile
 {
-    unsigned char buffer[32 * 1024 * 1024];
-    uint max;
-    OutputFile() :
-        max(0)
+    struct Extent
     {
-        memset(buffer, 0, sizeof(buffer));
-    }
+        uint address;
+        std::vector<unsigned char> bytes;
+        uint64_t end() const { return uint64_t(address) + bytes.size(); }
+    };
+    std::vector<Extent> extents;
+    size_t last; // extent the previous store went to
+    Symbol *origin; // set when writing an object file
+    std::vector<Relocation> relocations;
+    OutputFile() :
+        last(0),
+        origin(NULL)
+    {}
+    unsigned char *Reserve(uint address, uint size);
     void Store32(uint address, uint v)
     {
+        unsigned char *p = Reserve(address, 4);
         for(int i = 0; i < 4; i++)
-            buffer[address + i] = (v >> i * 8) & 0xff;
-        max = std::max(max, address + 4);
+            p[i] = (v >> i * 8) & 0xff;
     }
     void Store16(uint address, uint v)
     {
+        unsigned char *p = Reserve(address, 2);
         for(int i = 0; i < 2; i++)
-            buffer[address + i] = (v >> i * 8) & 0xff;
-        max = std::max(max, address + 2);
+            p[i] = (v >> i * 8) & 0xff;
     }
     void Store8(uint address, uint v)
     {
-        for(int i = 0; i < 1; i++)
-            buffer[address + i] = (v >> i * 8) & 0xff;
-        max = std::max(max, address + 0);
-    }
-    void FinishBIN(FILE *fp)
-    {
-        uint words = (max + 3) / 4;
-        fwrite(buffer, 4, words, fp);
+        unsigned char *p = Reserve(address, 1);
+        p[0] = v & 0xff;
     }
+    uint64_t End() const { return extents.empty() ? 0 : extents.back().end(); }
+    void Read(uint64_t address, unsigned char *dst, size_t size);
+    void FinishBIN(FILE *fp);
     void FinishMIF(FILE *fp);
+    void FinishSegments(FILE *fp);
 };
 
 struct Instruction
 {
-    typedef std::shared_ptr<Instruction> sptr;
     uint address;
     uint linenum;
     uint opcode;
-    virtual bool Store(labels_map& labels, OutputFile& file) = 0;
+    virtual bool Store(OutputFile& file) = 0;
     Instruction(uint address_, uint linenum_, uint opcode_) :
         address(address_),
         linenum(linenum_),
@@ -140,23 +276,21 @@ struct Instruction
 
 struct InstructionDirect : public Instruction
 {
-    typedef std::shared_ptr<InstructionDirect> sptr;
     InstructionDirect(uint address_, uint linenum_, uint opcode_) :
         Instruction(address_, linenum_, opcode_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionDirect() {}
 };
 
 struct InstructionRX : public Instruction
 {
     uint rx;
-    typedef std::shared_ptr<InstructionRX> sptr;
     InstructionRX(uint address_, uint linenum_, uint opcode_, uint rx_) :
         Instruction(address_, linenum_, opcode_),
         rx(rx_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionRX() {}
 };
 
@@ -164,25 +298,23 @@ struct InstructionRXRY : public Instruction
 {
     uint rx;
     uint ry;
-    typedef std::shared_ptr<InstructionRXRY> sptr;
     InstructionRXRY(uint address_, uint linenum_, uint opcode_, uint rx_, uint ry_) :
         Instruction(address_, linenum_, opcode_),
         rx(rx_),
         ry(ry_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionRXRY() {}
 };
 
 struct InstructionImm : public Instruction
 {
-    ExprBase::sptr imm;
-    typedef std::shared_ptr<InstructionImm> sptr;
-    InstructionImm(uint address_, uint linenum_, uint opcode_, const ExprBase::sptr& imm_) :
+    ExprBase *imm;
+    InstructionImm(uint address_, uint linenum_, uint opcode_, ExprBase* imm_) :
         Instruction(address_, linenum_, opcode_),
         imm(imm_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionImm() {}
 };
 
@@ -190,29 +322,27 @@ struct InstructionRXImmModified : public Instruction
 {
     uint modifier;
     uint rx;
-    ExprBase::sptr imm;
-    typedef std::shared_ptr<InstructionRXImmModified> sptr;
-    InstructionRXImmModified(uint address_, uint linenum_, uint opcode_, uint modifier_, uint rx_, const ExprBase::sptr& imm_) :
+    ExprBase *imm;
+    InstructionRXImmModified(uint address_, uint linenum_, uint opcode_, uint modifier_, uint rx_, ExprBase* imm_) :
         Instruction(address_, linenum_, opcode_),
         modifier(modifier_),
         rx(rx_),
         imm(imm_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionRXImmModified() {}
 };
 
 struct InstructionRXImm : public Instruction
 {
     uint rx;
-    ExprBase::sptr imm;
-    typedef std::shared_ptr<InstructionRXImm> sptr;
-    InstructionRXImm(uint address_, uint linenum_, uint opcode_, uint rx_, const ExprBase::sptr& imm_) :
+    ExprBase *imm;
+    InstructionRXImm(uint address_, uint linenum_, uint opcode_, uint rx_, ExprBase* imm_) :
         Instruction(address_, linenum_, opcode_),
         rx(rx_),
         imm(imm_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionRXImm() {}
 };
 
@@ -221,16 +351,15 @@ struct InstructionRXRYImmModified : public Instruction
     uint modifier;
     uint rx;
     uint ry;
-    ExprBase::sptr imm;
-    typedef std::shared_ptr<InstructionRXRYImmModified> sptr;
-    InstructionRXRYImmModified(uint address_, uint linenum_, uint opcode_, uint modifier_, uint rx_, uint ry_, const ExprBase::sptr& imm_) :
+    ExprBase *imm;
+    InstructionRXRYImmModified(uint address_, uint linenum_, uint opcode_, uint modifier_, uint rx_, uint ry_, ExprBase* imm_) :
         Instruction(address_, linenum_, opcode_),
         modifier(modifier_),
         rx(rx_),
         ry(ry_),
         imm(imm_)
         {}
-    virtual bool Store(labels_map& labels, OutputFile& file);
+    virtual bool Store(OutputFile& file);
     virtual ~InstructionRXRYImmModified() {}
 };
 
@@ -250,8 +379,8 @@ struct Store
     }
 };
 
-bool StoreInstructions(labels_map& labels, OutputFile& file, std::vector<Instruction::sptr>& instrs);
-bool StoreMemoryDirectives(labels_map& labels, OutputFile& file, std::vector<Store>& stores);
+bool StoreInstructions(OutputFile& file, std::vector<Instruction*>& instrs);
+bool StoreMemoryDirectives(OutputFile& file, std::vector<Store>& stores);
 
 struct ImmediateOperandInfo
 {
@@ -265,3 +394,46 @@ struct ImmediateOperandInfo
 
 extern ImmediateOperandInfo instr_infos[];
 
+// Object file, as "asm -o" writes and lnk reads: a header, then the
+// symbols, relocations and names, then each extent's address and size
+// followed by its bytes padded to 4.  Addresses are offsets from wherever
+// lnk places the object.  Only .global symbols are listed, plus the
+// undefined ones the relocations need.
+namespace object {
+    const char MAGIC[8] = {'S', 'C', 'P', 'U', 'O', 'B', 'J', '1'};
+    const uint32_t ORIGIN = 0xffffffff; // relocation symbol for the object's own address 0
+
+    const uint32_t DEFINED = 0x1;
+    const uint32_t RELATIVE = 0x2; // value is an offset from the object's address 0
+
+    struct header {
+        char magic[8];
+        uint32_t symbols;
+        uint32_t relocations;
+        uint32_t names; // bytes of NUL-terminated names
+        uint32_t extents;
+    };
+
+    struct symbol {
+        uint32_t name; // offset into the names
+        uint32_t value;
+        uint32_t flags;
+    };
+
+    struct relocation {
+        uint32_t address;
+        uint32_t linenum;
+        uint16_t kind; // Relocation::Kind
+        uint16_t part; // Term::Part
+        uint32_t symbol; // index, or ORIGIN
+        uint32_t offset;
+    };
+
+    struct extent {
+        uint32_t address;
+        uint32_t size;
+    };
+};
+
+bool WriteObject(FILE *fp, OutputFile& file, SymbolTable& symbols);
+
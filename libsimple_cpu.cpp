@@ -0,0 +1,130 @@
+#include "simulator.hpp"
+#include "libsimple_cpu.hpp"
+
+namespace simple_cpu {
+
+struct machine::impl
+{
+    simulator sim;
+    std::vector<uint8_t> program; // with harvard
+
+    impl(const sim_options& options) : sim(options) {}
+
+    stop_reason stopped() const
+    {
+        const state& s = sim.s;
+        if(s.memory_fault)
+            return FAULTED;
+        return s.halted ? HALTED : LIMITED;
+    }
+};
+
+static sim_options make_options(const machine_options& options)
+{
+    sim_options o;
+    o.memory_mib = options.memory_mib;
+    o.harvard = options.harvard;
+    o.threaded = options.threaded;
+    o.use_jit = options.jit;
+    o.exceptions = options.exceptions;
+    o.hypercalls = options.hypercalls;
+    o.console_fd = -1; // captured for take_console_output()
+    o.console_policy = console_device::FLUSH_HALT;
+    return o;
+}
+
+machine::machine(const machine_options& options) :
+    p(new impl(make_options(options)))
+{
+}
+
+machine::~machine()
+{
+    delete p;
+}
+
+bool machine::load(const void *image, size_t size, uint32_t address)
+{
+    state& s = p->sim.s;
+    if(p->sim.options.harvard) {
+        if(address != 0)
+            return false;
+        p->program.assign((const uint8_t *)image, (const uint8_t *)image + size);
+        p->program.resize((size + 3) & ~3);
+        s.separate_instructions = true;
+        s.program = (uint32_t *)p->program.data();
+        s.programsize = p->program.size() / 4;
+        s.invalidate_all_decoded();
+        return true;
+    }
+    return size <= 0xffffffff && s.write_block(address, (const uint8_t *)image, size) == size;
+}
+
+stop_reason machine::run(unsigned long long max_instructions)
+{
+    state& s = p->sim.s;
+    if(s.halted || s.memory_fault)
+        return p->stopped();
+    unsigned long long limit = s.instructions + max_instructions;
+    s.set_limit(limit < s.instructions ? ~0ULL : limit);
+    p->sim.execute();
+    return p->stopped();
+}
+
+stop_reason machine::step()
+{
+    state& s = p->sim.s;
+    if(s.halted || s.memory_fault)
+        return p->stopped();
+    s.single_step();
+    // due events and exceptions happen between instructions, as in run()
+    if(s.memory_fault)
+        s.take_exception();
+    else
+        s.run_events();
+    return p->stopped();
+}
+
+uint32_t machine::get_register(int r) const
+{
+    return (r >= 0 && r < registercount) ? p->sim.s.registers[r] : 0;
+}
+
+void machine::set_register(int r, uint32_t value)
+{
+    if(r >= 0 && r < registercount)
+        p->sim.s.registers[r] = value;
+}
+
+size_t machine::read_memory(uint32_t address, void *data, size_t size) const
+{
+    size = std::min(size, (size_t)0xffffffff);
+    return p->sim.s.read_block(address, (uint8_t *)data, size);
+}
+
+size_t machine::write_memory(uint32_t address, const void *data, size_t size)
+{
+    size = std::min(size, (size_t)0xffffffff);
+    return p->sim.s.write_block(address, (const uint8_t *)data, size);
+}
+
+unsigned long long machine::instructions() const
+{
+    return p->sim.s.instructions;
+}
+
+uint32_t machine::fault_address() const
+{
+    return p->sim.s.fault_address;
+}
+
+std::string machine::take_console_output()
+{
+    console_device& console = p->sim.console;
+    console.flush();
+    std::string output;
+    output.swap(console.captured);
+    return output;
+}
+
+};
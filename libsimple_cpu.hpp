@@ -0,0 +1,83 @@
+#include <cstddef>
+#include <string>
+#include <stdint.h>
+
+// Embeddable simple_cpu_2014 simulator, built as libsimple_cpu.a (link
+// with -lpthread -lz).  Each machine owns its memory, devices and JIT
+// code; machines share only read-only tables, so any number can run at
+// once, each on its own thread.  Only this header is needed; it doesn't
+// expose the simulator's internals, which change freely.
+//
+//   simple_cpu::machine m;
+//   m.load(image, size);
+//   if(m.run(1000000) == simple_cpu::HALTED)
+//       printf("R0 = %08X\n", m.get_register(0));
+
+namespace simple_cpu {
+
+enum stop_reason {
+    HALTED,     // executed HALT
+    FAULTED,    // an access or instruction the guest didn't handle
+    LIMITED,    // ran the instructions asked for
+};
+
+struct machine_options
+{
+    uint64_t memory_mib; // RAM from address 0, allocated as touched (at most 4096)
+    bool harvard; // load() gives the program, separate from RAM
+    bool threaded; // computed-goto interpreter
+    bool jit; // translate to x86-64 where available; run() may then overshoot by a block
+    bool exceptions; // deliver faults to the guest's vectors instead of stopping
+    bool hypercalls; // run SYS 0x3c-0x3f on the host
+
+    machine_options() :
+        memory_mib(64),
+        harvard(false),
+        threaded(true),
+        jit(false),
+        exceptions(false),
+        hypercalls(false)
+    {}
+};
+
+class machine
+{
+public:
+    explicit machine(const machine_options& options = machine_options());
+    ~machine();
+
+    // Copies image into RAM at address, or with harvard makes it the
+    // program; false if it doesn't all fit
+    bool load(const void *image, size_t size, uint32_t address = 0);
+
+    // Runs until the guest halts or faults or max_instructions more have
+    // executed; calling again carries on
+    stop_reason run(unsigned long long max_instructions);
+
+    // Executes one instruction
+    stop_reason step();
+
+    // 0-7; 6 is SP and 7 is PC
+    uint32_t get_register(int r) const;
+    void set_register(int r, uint32_t value);
+
+    // Copy to and from guest RAM, stopping at the first address that isn't
+    // RAM; return bytes copied
+    size_t read_memory(uint32_t address, void *data, size_t size) const;
+    size_t write_memory(uint32_t address, const void *data, size_t size);
+
+    unsigned long long instructions() const;
+    uint32_t fault_address() const; // if run() or step() returned FAULTED
+
+    // Console output since the last call
+    std::string take_console_output();
+
+private:
+    struct impl;
+    impl *p;
+
+    machine(const machine&);
+    machine& operator=(const machine&);
+};
+
+};
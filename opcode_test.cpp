@@ -0,0 +1,155 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include "simple_cpu_2014.hpp"
+#include "util.hpp"
+
+// Runs every opcode, load/store size and shift type in a loop, folding the
+// results into R3, so "make jittest" can check the JIT ends in the same
+// state as the stepping interpreter.  Ends on an illegal instruction.
+
+const uint32_t sys_vector = 0x20;
+
+void write_opcode_test_program(memory& m, uint32_t base)
+{
+    using namespace simple_cpu_2014;
+
+    uint32_t a = base;
+
+    auto append = [&] (uint32_t data) {
+        m.w(a, data);
+        a += 4;
+    };
+
+    // R0 link and scratch, R1 data, R2 push/sys address, R3 result,
+    // R4 loop count, R5 scratch
+    append(MOVIU(reg::SP, 0));
+    append(ADDIU(reg::SP, 0x1800));
+    append(MOVIU(reg::R1, 0));
+    append(ADDIU(reg::R1, 0x1000));
+    append(MOVIU(reg::R3, 0x9234)); // negative, so RL and RA differ
+    append(ADDI(reg::R3, 0x5678));
+    append(MOVIU(reg::R4, 0));
+    append(ADDIU(reg::R4, 100));
+
+    uint32_t loop = a;
+    append(MOV(reg::R5, reg::R4, 0, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(XOR(reg::R5, reg::R3, 0, 0));
+    append(SUB(reg::R3, reg::R5, 0, 0));
+    append(OR(reg::R5, reg::R4, 0, 0));
+    append(AND(reg::R5, reg::R3, 0, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(NOT(reg::R5, reg::R4, 0, 0));
+    append(XOR(reg::R3, reg::R5, 0, 0));
+    append(ADD(reg::R3, reg::R4, 0, 0));
+
+    append(MOV(reg::R5, reg::R3, 0, 0));
+    append(SHIFT(reg::R5, (shifttype::RL << 18) | 3));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(SHIFT(reg::R5, (shifttype::RA << 18) | 1));
+    append(XOR(reg::R3, reg::R5, 0, 0));
+    append(SHIFT(reg::R5, (shifttype::LL << 18) | 5));
+    append(SUB(reg::R3, reg::R5, 0, 0));
+    append(SHIFT(reg::R5, (shifttype::LA << 18) | 2));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+
+    // small operands, so the product fits in 32 bits
+    append(MOV(reg::R5, reg::R3, 0, 0));
+    append(MOVIU(reg::R0, 0));
+    append(ADDIU(reg::R0, 0xfff));
+    append(AND(reg::R5, reg::R0, 0, 0));
+    append(MOV(reg::R0, reg::R4, 0, 0));
+    append(ADDI(reg::R0, 3));
+    append(MULT(reg::R5, reg::R0, 0, 0)); // R5 = high, R0 = low
+    append(ADD(reg::R3, reg::R0, 0, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(MOV(reg::R5, reg::R3, 0, 0));
+    append(MOVIU(reg::R0, 0));
+    append(ADDI(reg::R0, 7));
+    append(DIV(reg::R5, reg::R0, 0, 0)); // R5 = quotient, R0 = remainder
+    append(ADD(reg::R3, reg::R0, 0, 0));
+    append(XOR(reg::R3, reg::R5, 0, 0));
+    append(XCHG(reg::R3, reg::R5, 0, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+
+    append(CMPIU(reg::R3, 0x800000));
+    append(format24(opcode::SWAPCC, reg::R5, 0)); // R5 = flags
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(MOVIU(reg::R5, 0));
+    append(ADDI(reg::R5, 0x8));
+    append(format24(opcode::SWAPCC, reg::R5, 0)); // set carry
+    append(ADC(reg::R3, reg::R4, 0, 0));
+
+    append(STORE(reg::R1, reg::R3, opsize::SIZE_8, 0));
+    append(STORE(reg::R1, reg::R3, opsize::SIZE_16, 2));
+    append(STORE(reg::R1, reg::R3, opsize::SIZE_32, 4));
+    append(LOAD(reg::R5, reg::R1, opsize::SIZE_8, 4));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(LOAD(reg::R5, reg::R1, opsize::SIZE_16, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(LOAD(reg::R5, reg::R1, opsize::SIZE_32, 0));
+    append(XOR(reg::R3, reg::R5, 0, 0));
+
+    // PUSH and SYS store at the address in R2
+    append(MOV(reg::R2, reg::SP, 0, 0));
+    append(ADDI(reg::R2, -4));
+    append(PUSH(reg::R3, 0));
+    append(PUSH(reg::R4, 0));
+    append(POP(reg::R5, 0));
+    append(POP(reg::R0, 0));
+    append(ADD(reg::R3, reg::R5, 0, 0));
+    append(ADD(reg::R3, reg::R0, 0, 0));
+    append(MOV(reg::R2, reg::SP, 0, 0));
+    append(ADDI(reg::R2, -4));
+    append(SYS(sys_vector));
+
+    uint32_t subroutine_call = a;
+    append(0); // patched with JSR to the subroutine, linking in R0
+
+    // JSR with PC as its link register is a relative jump back to "back"
+    uint32_t skip_back = a;
+    append(0);
+    uint32_t back = a;
+    append(ADDI(reg::R3, 5));
+    uint32_t skip_ahead = a;
+    append(0);
+    m.w(skip_back, JMP(a / 4));
+    append(JSR((back - (a + 4)) / 4));
+    m.w(skip_ahead, JMP(a / 4));
+
+    append(MOV(reg::R5, reg::R4, 0, 0));
+    append(CMP(reg::R5, reg::R3, 0, 0));
+    append(JL(2));
+    append(ADDI(reg::R3, 1));
+    append(CMP(reg::R5, reg::R4, 0, 0));
+    append(JNE(2));
+    append(ADDI(reg::R3, 2));
+
+    append(ADDI(reg::R4, -1));
+    append(CMPIU(reg::R4, 0));
+    append(JNE((loop - a) / 4));
+    append(format27(opcode::UNUSED_19, 0));
+
+    m.w(subroutine_call, JSR((a - subroutine_call) / 4));
+    append(ADDI(reg::R3, 0x11));
+    append(JR(reg::R0, 0));
+
+    // SYS pushes its own address; return past it
+    a = sys_vector * 4;
+    append(POP(reg::R0, 0));
+    append(ADDI(reg::R3, 0x22));
+    append(JR(reg::R0, 1));
+}
+
+int main()
+{
+    test_memory mem;
+
+    const int testaddr = 0x100;
+
+    write_vectors(mem, testaddr / 4);
+    write_opcode_test_program(mem, testaddr);
+
+    fwrite(mem.memory, sizeof(mem.memory), 1, stdout);
+}
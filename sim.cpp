@@ -1,493 +1,912 @@
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <boost/program_options.hpp>
-#include "simple_cpu_2014.hpp"
+#include "simulator.hpp"
 
-const int memsize = 32 * 1024 * 1024;
-const int registercount = 8;
-const int CONSOLE_OUTPUT = 0xf0000000;
-
-using namespace simple_cpu_2014;
+namespace po = boost::program_options;
 
-int32_t sign_extend(uint32_t v, int bits)
-{
-    bool negative = v & (1 << (bits - 1));
-    return negative ? (v | (0xffffffff << bits)) : v;
-}
+// GDB remote serial protocol server for one debugger connection over TCP
+// on 127.0.0.1 or a Unix socket.  Registers are R0..R5, SP, PC, each 32
+// bits little-endian.  The guest runs at full speed in slices of
+// gdb_slice instructions, checking for an interrupt from the debugger in
+// between; breakpoints cost nothing until one is reached (see
+// state::mark_breakpoint()).
+const unsigned long long gdb_slice = 1000000;
 
-struct state
+struct gdb_server
 {
-    int32_t registers[registercount];
-    bool lt, eq, gt, halted;
-    bool separate_instructions;
-    int carry;
-
-    uint8_t memory[memsize];
-    bool memory_fault;
-    uint32_t fault_address;
-
-    uint32_t fetch32(uint32_t addr)
+    simulator& sim;
+    int fd;
+    char buffer[4096]; // received but not yet read
+    size_t have, used;
+    bool disconnected;
+
+    gdb_server(simulator& sim_) : sim(sim_), fd(-1), have(0), used(0), disconnected(false) {}
+    ~gdb_server() { if(fd >= 0) close(fd); }
+
+    // A port number listens on 127.0.0.1, anything else is a socket path;
+    // waits for the debugger to connect
+    bool accept_connection(const std::string& address)
     {
-        if(addr > memsize - 4) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return 0;
+        bool tcp = address.find_first_not_of("0123456789") == std::string::npos;
+        int listener = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+        if(listener < 0)
+            return false;
+
+        bool ok;
+        if(tcp) {
+            int one = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_port = htons(atoi(address.c_str()));
+            sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            ok = bind(listener, (sockaddr *)&sin, sizeof(sin)) == 0;
+        } else {
+            sockaddr_un sun;
+            memset(&sun, 0, sizeof(sun));
+            sun.sun_family = AF_UNIX;
+            strncpy(sun.sun_path, address.c_str(), sizeof(sun.sun_path) - 1);
+            unlink(sun.sun_path);
+            ok = bind(listener, (sockaddr *)&sun, sizeof(sun)) == 0;
         }
 
-        return
-            (memory[addr + 0] << 0) | 
-            (memory[addr + 1] << 8) | 
-            (memory[addr + 2] << 16) | 
-            (memory[addr + 3] << 24);
+        if(ok && listen(listener, 1) == 0) {
+            fprintf(stderr, "waiting for gdb on %s\n", address.c_str());
+            fd = accept(listener, NULL, NULL);
+        }
+        close(listener);
+        if(fd >= 0 && tcp) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd >= 0;
     }
 
-    uint32_t fetch16(uint32_t addr)
+    // Next byte from the debugger, or -1 once it has gone
+    int get()
     {
-        if(addr > memsize - 2) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return 0;
+        if(used == have) {
+            ssize_t n;
+            do
+                n = ::read(fd, buffer, sizeof(buffer));
+            while(n < 0 && errno == EINTR);
+            if(n <= 0) {
+                disconnected = true;
+                return -1;
+            }
+            have = n;
+            used = 0;
         }
-
-        return
-            (memory[addr + 0] << 0) | 
-            (memory[addr + 1] << 8);
+        return (unsigned char)buffer[used++];
     }
 
-    uint32_t fetch8(uint32_t addr)
+    void put(const std::string& data)
     {
-        if(addr > memsize - 1) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return 0;
+        size_t done = 0;
+        while(done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                return;
+            done += n;
         }
+    }
 
-        return memory[addr + 0];
+    static int hex_digit(int c)
+    {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
     }
 
-    void store32(uint32_t addr, uint32_t value)
+    static std::string hex32(uint32_t v)
     {
-        if(addr > memsize - 4) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return;
-        }
+        char text[9];
+        snprintf(text, sizeof(text), "%02x%02x%02x%02x", v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+        return text;
+    }
 
-        memory[addr + 0] = (value >> 0) & 0xff;
-        memory[addr + 1] = (value >> 8) & 0xff;
-        memory[addr + 2] = (value >> 16) & 0xff;
-        memory[addr + 3] = (value >> 24) & 0xff;
+    static uint32_t parse_hex32(const char *p)
+    {
+        uint32_t v = 0;
+        for(int i = 0; i < 4 && hex_digit(p[0]) >= 0 && hex_digit(p[1]) >= 0; i++, p += 2)
+            v |= (hex_digit(p[0]) * 16 + hex_digit(p[1])) << (i * 8);
+        return v;
     }
 
-    void store16(uint32_t addr, uint32_t value)
+    // Sends "$data#checksum" until the debugger acknowledges it
+    bool send(const std::string& data)
     {
-        if(addr > memsize - 2) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return;
+        unsigned char sum = 0;
+        for(size_t i = 0; i < data.size(); i++)
+            sum += data[i];
+        char trailer[4];
+        snprintf(trailer, sizeof(trailer), "#%02x", sum);
+        std::string packet = "$" + data + trailer;
+        for(;;) {
+            put(packet);
+            int c = get();
+            if(c == '+')
+                return true;
+            if(c < 0)
+                return false;
         }
-
-        memory[addr + 0] = (value >> 0) & 0xff;
-        memory[addr + 1] = (value >> 8) & 0xff;
     }
 
-    void store8(uint32_t addr, uint32_t value)
+    // Next packet, acknowledged; an interrupt arrives as "\x03"
+    bool receive(std::string& data)
     {
-        if(addr == CONSOLE_OUTPUT) {
-            putchar(value & 0xff);
-            return;
+        for(;;) {
+            int c = get();
+            if(c < 0)
+                return false;
+            if(c == 0x03) {
+                data = "\x03";
+                return true;
+            }
+            if(c != '$')
+                continue;
+
+            data.clear();
+            unsigned char sum = 0;
+            while((c = get()) >= 0 && c != '#') {
+                data += (char)c;
+                sum += c;
+            }
+            int high = get(), low = get();
+            if(low < 0)
+                return false;
+            if(hex_digit(high) * 16 + hex_digit(low) == sum) {
+                put("+");
+                return true;
+            }
+            put("-");
         }
+    }
 
-        if(addr > memsize - 1) {
-            memory_fault = true; fault_address = addr;
-            // XXX probably invoke interrupt or something here, and not halt
-            halted = true;
-            return;
+    // Whether the debugger has sent an interrupt since the guest resumed,
+    // or has gone; at end of file poll() keeps reporting input, so a
+    // disconnect has to stop the loop too
+    bool interrupted()
+    {
+        while(!disconnected && (used < have || poll_input())) {
+            int c = get();
+            if(c == 0x03 || c < 0)
+                return true;
         }
-
-        memory[addr] = value & 0xff;
+        return disconnected;
     }
 
-    state() { reset(); }
-    void reset()
+    bool poll_input()
     {
-        separate_instructions = false;
-        for(int i = 0; i < registercount; i++)
-            registers[i] = 0 ;
-        carry = 0;
-        lt = false;
-        eq = false;
-        gt = false;
-        halted = false;
-        registers[reg::PC] = 0x0;
+        pollfd p = { fd, POLLIN, 0 };
+        return poll(&p, 1, 0) > 0 && (p.revents & POLLIN);
     }
-};
-
-struct instruction
-{
-    uint opcode;
-    uint dst;
-    uint src;
-    uint modifier;
-    uint data;
-    instruction(uint32_t value);
-};
-
-typedef std::pair<bool, uint32_t> memory_changed;
-
-typedef memory_changed (*instructionfunc)(state&, const instruction&);
-
-struct opcode_info {
-    int datasize;
-    const char *name;
-    instructionfunc func;
-};
-
-extern opcode_info opcodes[];
-
-memory_changed moviu(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] = instr.data << 16;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
-
-memory_changed addi(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] += sign_extend(instr.data, opcodes[instr.opcode].datasize);
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
-
-memory_changed addiu(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] += instr.data;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
-
-memory_changed shift(state& s, const instruction& instr)
-{
-    if(instr.modifier == shifttype::RL)
-        s.registers[instr.dst] >>= (instr.data & 0x1f);
-    else if(instr.modifier == shifttype::LL)
-        s.registers[instr.dst] <<= (instr.data & 0x1f);
-    else if(instr.modifier == shifttype::RA)
-        s.registers[instr.dst] = s.registers[instr.dst] >> (instr.data & 0x1f);
-    else if(instr.modifier == shifttype::LA)
-        s.registers[instr.dst] = s.registers[instr.dst] << (instr.data & 0x1f);
-
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
-
-memory_changed cmpiu(state& s, const instruction& instr)
-{
-    s.eq = (((uint32_t)s.registers[instr.dst] & 0xffffff) == instr.data);
-    s.lt = (((uint32_t)s.registers[instr.dst] & 0xffffff) < instr.data);
-    s.gt = (((uint32_t)s.registers[instr.dst] & 0xffffff) > instr.data);
-
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
 
-memory_changed store(state& s, const instruction& instr)
-{
-    uint32_t addr = s.registers[instr.dst] + sign_extend(instr.data, 18);
-    switch(instr.modifier) {
-        case opsize::SIZE_8: s.store8(addr, s.registers[instr.src]); break;
-        case opsize::SIZE_16: s.store16(addr, s.registers[instr.src]); break;
-        case opsize::SIZE_32: s.store32(addr, s.registers[instr.src]); break;
-    }
-    if(s.memory_fault)
-        return memory_changed(false, 0);
-    s.registers[reg::PC] += 4;
-    return memory_changed(true, addr);
-}
+    std::string stop_reply()
+    {
+        const state& s = sim.s;
+        if(s.memory_fault && s.fault_vector == vectors::ILLEGAL)
+            return "S04"; // SIGILL
+        if(s.memory_fault && s.fault_vector == vectors::UNALIGNED)
+            return "S07"; // SIGBUS
+        if(s.memory_fault)
+            return "S0b"; // SIGSEGV
+        if(s.halted)
+            return "W00";
+        return "S05"; // SIGTRAP
+    }
 
-memory_changed load(state& s, const instruction& instr)
-{
-    uint32_t addr = s.registers[instr.src] + sign_extend(instr.data, 18);
-    uint32_t data = 0xffffffff;
-    switch(instr.modifier) {
-        case opsize::SIZE_8: data = s.fetch8(addr); break;
-        case opsize::SIZE_16: data = s.fetch16(addr); break;
-        case opsize::SIZE_32: data = s.fetch32(addr); break;
-    }
-    if(s.memory_fault)
-        return memory_changed(false, 0);
-    s.registers[instr.dst] = data;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    // Runs the guest until it stops for the debugger; returns the stop reply
+    std::string resume(bool step)
+    {
+        state& s = sim.s;
+        if(s.halted)
+            return stop_reply();
+
+        // a step, or leaving a breakpoint, runs one instruction past it
+        if(step || s.breakpoints.count(s.registers[reg::PC])) {
+            s.single_step();
+            if(step || s.halted)
+                return stop_reply();
+        }
 
-memory_changed mov(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] = s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+        for(;;) {
+            unsigned long long limit = sim.options.max_instructions;
+            s.set_limit(std::min(limit, s.instructions + gdb_slice));
+            sim.execute();
+            if(s.trapped) {
+                s.trapped = false;
+                s.memory_fault = false;
+                return "S05";
+            }
+            if(s.halted || s.memory_fault || s.instructions >= limit)
+                return stop_reply();
+            if(interrupted())
+                return "S02"; // SIGINT
+        }
+    }
 
-memory_changed push(state& s, const instruction& instr)
-{
-    s.store32(s.registers[reg::SP - 4], s.registers[instr.dst]); // dst is first reg
-    if(s.memory_fault)
-        return memory_changed(false, 0);
-    s.registers[reg::SP] -= 4;
-    s.registers[reg::PC] += 4;
-    return memory_changed(true, s.registers[reg::SP]);
-}
+    std::string read_memory(uint32_t addr, uint32_t len)
+    {
+        std::vector<uint8_t> data(len);
+        uint32_t n = sim.s.read_block(addr, len ? &data[0] : NULL, len);
+        if(n == 0 && len > 0)
+            return "E01";
+        std::string reply;
+        char text[3];
+        for(uint32_t i = 0; i < n; i++) {
+            snprintf(text, sizeof(text), "%02x", data[i]);
+            reply += text;
+        }
+        return reply;
+    }
 
-memory_changed pop(state& s, const instruction& instr)
-{
-    uint32_t data = s.fetch32(s.registers[reg::SP]);
-    if(s.memory_fault)
-        return memory_changed(false, 0);
-    s.registers[instr.dst] = data;
-    s.registers[reg::SP] += 4;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    std::string write_memory(uint32_t addr, uint32_t len, const char *hex)
+    {
+        std::vector<uint8_t> data(len);
+        for(uint32_t i = 0; i < len; i++) {
+            if(hex_digit(hex[0]) < 0 || hex_digit(hex[1]) < 0)
+                return "E02";
+            data[i] = hex_digit(hex[0]) * 16 + hex_digit(hex[1]);
+            hex += 2;
+        }
+        return (sim.s.write_block(addr, len ? &data[0] : NULL, len) == len) ? "OK" : "E01";
+    }
 
-memory_changed op_and(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] &= s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    // Serves the debugger until it detaches or disconnects (true) or kills
+    // the guest (false).  Breakpoints are cleared either way.
+    bool serve()
+    {
+        state& s = sim.s;
+        std::string packet;
+        bool keep_running = true;
+
+        while(!disconnected && receive(packet)) {
+            const char *p = packet.c_str();
+            std::string reply;
+            unsigned int n;
+            uint32_t addr, len;
+
+            switch(p[0]) {
+                case '?':
+                    reply = s.halted ? stop_reply() : "S05";
+                    break;
+                case 'g':
+                    for(int i = 0; i < registercount; i++)
+                        reply += hex32(s.registers[i]);
+                    break;
+                case 'G':
+                    if(packet.size() < 1 + registercount * 8) {
+                        reply = "E01";
+                        break;
+                    }
+                    for(int i = 0; i < registercount; i++)
+                        s.registers[i] = parse_hex32(p + 1 + i * 8);
+                    reply = "OK";
+                    break;
+                case 'p':
+                    n = strtoul(p + 1, NULL, 16);
+                    reply = (n < registercount) ? hex32(s.registers[n]) : "E01";
+                    break;
+                case 'P': {
+                    const char *value = strchr(p, '=');
+                    n = strtoul(p + 1, NULL, 16);
+                    if(n < registercount && value != NULL) {
+                        s.registers[n] = parse_hex32(value + 1);
+                        reply = "OK";
+                    } else
+                        reply = "E01";
+                    break;
+                }
+                case 'm':
+                    if(sscanf(p + 1, "%x,%x", &addr, &len) == 2)
+                        reply = read_memory(addr, std::min(len, 2048u));
+                    else
+                        reply = "E01";
+                    break;
+                case 'M': {
+                    const char *data = strchr(p, ':');
+                    if(sscanf(p + 1, "%x,%x", &addr, &len) == 2 && data != NULL && strlen(data + 1) >= len * 2)
+                        reply = write_memory(addr, len, data + 1);
+                    else
+                        reply = "E01";
+                    break;
+                }
+                case 'Z':
+                case 'z':
+                    // software and hardware breakpoints are the same here
+                    if((p[1] == '0' || p[1] == '1') && sscanf(p + 2, ",%x", &addr) == 1) {
+                        if(p[0] == 'Z')
+                            s.set_breakpoint(addr);
+                        else
+                            s.clear_breakpoint(addr);
+                        reply = "OK";
+                    }
+                    break;
+                case 'c':
+                case 's':
+                    if(p[1] != '\0')
+                        s.registers[reg::PC] = strtoul(p + 1, NULL, 16);
+                    reply = resume(p[0] == 's');
+                    if(disconnected)
+                        goto done;
+                    break;
+                case '\x03':
+                    reply = "S02";
+                    break;
+                case 'H':
+                    reply = "OK";
+                    break;
+                case 'q':
+                    if(packet.compare(0, 10, "qSupported") == 0)
+                        reply = "PacketSize=1000";
+                    else if(packet == "qAttached")
+                        reply = "1";
+                    else if(packet == "qfThreadInfo")
+                        reply = "m1";
+                    else if(packet == "qsThreadInfo")
+                        reply = "l";
+                    else if(packet == "qC")
+                        reply = "QC1";
+                    break;
+                case 'D':
+                    send("OK");
+                    goto done;
+                case 'k':
+                    keep_running = false;
+                    goto done;
+            }
+            if(!send(reply))
+                break;
+        }
+    done:
+        std::vector<uint32_t> pcs(s.breakpoints.begin(), s.breakpoints.end());
+        for(size_t i = 0; i < pcs.size(); i++)
+            s.clear_breakpoint(pcs[i]);
+        s.set_limit(sim.options.max_instructions);
+        return keep_running;
+    }
+};
 
-memory_changed op_or(state& s, const instruction& instr)
+std::string json_string(const std::string& str)
 {
-    s.registers[instr.dst] |= s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
+    std::string out = "\"";
+    for(size_t i = 0; i < str.size(); i++) {
+        unsigned char c = str[i];
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if(c < 0x20 || c >= 0x7f) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else
+            out += c;
+    }
+    return out + "\"";
 }
 
-memory_changed op_xor(state& s, const instruction& instr)
+// The end state of one run as JSON, following the given leading fields
+std::string json_summary(std::string line, simulator& sim)
 {
-    s.registers[instr.dst] ^= s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
+    const state& s = sim.s;
+    char text[256];
+
+    snprintf(text, sizeof(text), ",\"halt\":\"%s\"", sim.halt_reason());
+    line += text;
+    if(s.memory_fault) {
+        snprintf(text, sizeof(text), ",\"fault_address\":%u", s.fault_address);
+        line += text;
+    }
+    line += ",\"registers\":[";
+    for(int i = 0; i < registercount; i++) {
+        snprintf(text, sizeof(text), "%s%u", (i > 0) ? "," : "", (uint32_t)s.registers[i]);
+        line += text;
+    }
+    snprintf(text, sizeof(text), "],\"instructions\":%llu", s.instructions);
+    line += text;
+    return line + ",\"console\":" + json_string(sim.console.captured) + "}";
 }
 
-memory_changed op_not(state& s, const instruction& instr)
+// Runs one batch image and returns its summary as a single JSON line
+std::string run_batch_image(const sim_options& options, const std::string& image_name)
 {
-    s.registers[instr.dst] = ~s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    std::string line = "{\"image\":" + json_string(image_name);
 
-memory_changed add(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] += s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    // XXX carry
-    return memory_changed(false, 0);
-}
+    size_t imagesize;
+    uint8_t *image = map_image(image_name.c_str(), &imagesize);
+    if(image == NULL)
+        return line + ",\"halt\":\"error\",\"error\":" + json_string(strerror(errno)) + "}";
 
-memory_changed adc(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] += s.registers[instr.src] + s.carry;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    {
+        std::unique_ptr<simulator> sim(new simulator(options));
+        if(sim->load(image, imagesize, true)) {
+            sim->run();
+            line = json_summary(line, *sim);
+        } else {
+            line += ",\"halt\":\"error\",\"error\":\"malformed segmented image, or a segment outside RAM\"}";
+        }
+    }
 
-memory_changed sub(state& s, const instruction& instr)
-{
-    s.registers[instr.dst] -= s.registers[instr.src];
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
+    munmap(image, std::max(imagesize, (size_t)1));
+    return line;
 }
 
-memory_changed mult(state& s, const instruction& instr)
+// Work-stealing pool: each worker starts with an even share of the images
+// and takes from the front of its own queue, then steals from the back of
+// the others' once it runs dry, so a few long-running images don't leave
+// the other threads idle.
+struct batch_queue
 {
-    long long v = s.registers[instr.dst] * s.registers[instr.src];
-    s.registers[instr.dst] = v >> 32;
-    s.registers[instr.src] = v & 0xffffffff;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    std::mutex lock;
+    std::deque<size_t> jobs;
+};
 
-memory_changed div(state& s, const instruction& instr)
+bool take_batch_job(std::vector<batch_queue>& queues, size_t self, size_t *job)
 {
-    int32_t d = s.registers[instr.dst] / s.registers[instr.src];
-    int32_t m = s.registers[instr.dst] % s.registers[instr.src];
-    s.registers[instr.dst] = d;
-    s.registers[instr.src] = m;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
+    for(size_t i = 0; i < queues.size(); i++) {
+        batch_queue& q = queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if(q.jobs.empty())
+            continue;
+        if(i == 0) {
+            *job = q.jobs.front();
+            q.jobs.pop_front();
+        } else {
+            *job = q.jobs.back();
+            q.jobs.pop_back();
+        }
+        return true;
+    }
+    return false;
 }
 
-memory_changed cmp(state& s, const instruction& instr)
+void run_batch(const sim_options& options, const std::vector<std::string>& images, unsigned int jobs)
 {
-    s.eq = (s.registers[instr.dst] == s.registers[instr.src]);
-    s.lt = (s.registers[instr.dst] < s.registers[instr.src]);
-    s.gt = (s.registers[instr.dst] > s.registers[instr.src]);
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
+    std::vector<std::string> results(images.size());
+    jobs = std::max(1u, std::min(jobs, (unsigned int)images.size()));
+
+    std::vector<batch_queue> queues(jobs);
+    for(size_t i = 0; i < images.size(); i++)
+        queues[i % jobs].jobs.push_back(i);
+
+    std::vector<std::thread> workers;
+    for(unsigned int w = 0; w < jobs; w++)
+        workers.push_back(std::thread([&, w]() {
+            size_t job;
+            while(take_batch_job(queues, w, &job))
+                results[job] = run_batch_image(options, images[job]);
+        }));
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for(size_t i = 0; i < results.size(); i++)
+        printf("%s\n", results[i].c_str());
 }
 
-memory_changed xchg(state& s, const instruction& instr)
+// Lockstep execution of one program on many lanes, for parameter sweeps.
+// Registers and flags are kept structure-of-arrays, one int32_t per lane,
+// and each step runs the instruction at the lowest PC among the running
+// lanes, so lanes that split at a branch meet again after it.  Register
+// ALU ops and direct branches are applied with AVX2 to eight lanes at a
+// time, masking off lanes at other PCs; everything else, and every
+// instruction without AVX2, runs through opcodes[] on each lane's own
+// state.  A vector step decodes the instruction from the first lane at
+// that PC, so lanes must not rewrite their code differently.  Faults
+// (handled as usual with --exceptions) and events such as timer
+// interrupts reach each lane through its own state too.
+const size_t lockstep_width = 8; // 32-bit lanes per AVX2 register
+
+struct lockstep
 {
-    int32_t t = s.registers[instr.dst];
-    s.registers[instr.dst] = s.registers[instr.src];
-    s.registers[instr.src] = t;
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    std::vector<simulator *> lanes;
+    size_t count; // lanes rounded up to a whole vector
+    std::vector<int32_t> registers; // register r of lane i at [r * count + i]
+    std::vector<int32_t> lt, eq, gt; // 0 or -1
+    std::vector<int32_t> active; // -1 while the lane is running
+    std::vector<uint32_t> counts; // instructions since the last fold()
+    bool use_avx2;
+
+    lockstep(const std::vector<simulator *>& lanes_) :
+        lanes(lanes_),
+        count((lanes_.size() + lockstep_width - 1) / lockstep_width * lockstep_width),
+        registers(registercount * count, 0),
+        lt(count, 0), eq(count, 0), gt(count, 0),
+        active(count, 0),
+        counts(count, 0)
+    {
+#if defined(__x86_64__)
+        use_avx2 = __builtin_cpu_supports("avx2");
+#else
+        use_avx2 = false;
+#endif
+        for(size_t i = 0; i < lanes.size(); i++) {
+            state& s = lanes[i]->s;
+            s.fuse = false; // a fused pair would take two lanes' steps in one
+            from_state(i);
+            active[i] = (s.halted || s.memory_fault) ? 0 : -1;
+        }
+    }
 
-memory_changed jne(state& s, const instruction& instr)
-{
-    if(s.eq)
-        s.registers[reg::PC] += 4;
-    else
-        s.registers[reg::PC] += sign_extend(instr.data, 27) << 2;
-    return memory_changed(false, 0);
-}
+    int32_t *column(uint r) { return &registers[r * count]; }
 
-memory_changed jl(state& s, const instruction& instr)
-{
-    if(s.lt)
-        s.registers[reg::PC] += sign_extend(instr.data, 27) << 2; // XXX proposed
-    else
-        s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    void from_state(size_t i)
+    {
+        const state& s = lanes[i]->s;
+        for(uint r = 0; r < registercount; r++)
+            column(r)[i] = s.registers[r];
+        lt[i] = s.lt ? -1 : 0;
+        eq[i] = s.eq ? -1 : 0;
+        gt[i] = s.gt ? -1 : 0;
+    }
 
-memory_changed jsr(state& s, const instruction& instr)
-{
-    // Rx <= pc, pc <= pc + (sdata24 << 2))
-    s.registers[instr.dst] = s.registers[reg::PC] + 4; // XXX proposed
-    s.registers[reg::PC] += sign_extend(instr.data, 27) << 2;
-    return memory_changed(false, 0);
-}
+    void to_state(size_t i)
+    {
+        state& s = lanes[i]->s;
+        for(uint r = 0; r < registercount; r++)
+            s.registers[r] = column(r)[i];
+        s.lt = lt[i];
+        s.eq = eq[i];
+        s.gt = gt[i];
+    }
 
-memory_changed jmp(state& s, const instruction& instr)
-{
-    s.registers[reg::PC] = sign_extend(instr.data, 27) << 2;
-    return memory_changed(false, 0);
-}
+    void fold()
+    {
+        for(size_t i = 0; i < lanes.size(); i++) {
+            lanes[i]->s.instructions += counts[i];
+            counts[i] = 0;
+        }
+    }
 
-memory_changed jr(state& s, const instruction& instr)
-{
-    s.registers[reg::PC] = s.registers[instr.dst] + (sign_extend(instr.data, 24) << 2);
-    return memory_changed(false, 0);
-}
+    // Runs one instruction on lane i through its own state
+    void step_lane(size_t i)
+    {
+        state& s = lanes[i]->s;
+        to_state(i);
+        s.instructions += counts[i]; // devices such as the timer read it
+        counts[i] = 0;
+        const decoded_instruction& d = s.decode(s.registers[reg::PC]);
+        if(!s.memory_fault) {
+            d.func(s, d.instr);
+            if(!s.memory_fault)
+                s.instructions++;
+        }
+        if(s.memory_fault)
+            s.take_exception();
+        from_state(i);
+        if(s.halted || s.memory_fault)
+            active[i] = 0;
+    }
 
-memory_changed sys(state& s, const instruction& instr)
-{
-    s.store32(s.registers[reg::SP - 4], s.registers[reg::PC]); // dst is first reg
-    if(s.memory_fault)
-        return memory_changed(false, 0);
-    s.registers[reg::SP] -= 4;
-    s.registers[reg::PC] = instr.data << 2;
-    return memory_changed(true, s.registers[reg::SP]);
-}
+    // Step at which lane i may reach its next event, given that it runs
+    // at most one instruction per step from "steps" on
+    unsigned long long next_event(size_t i, unsigned long long steps)
+    {
+        const state& s = lanes[i]->s;
+        if(s.events.empty())
+            return ~0ULL;
+        unsigned long long done = s.instructions + counts[i];
+        return steps + (s.events.front().when > done ? s.events.front().when - done : 0);
+    }
 
-memory_changed halt(state& s, const instruction& instr)
-{
-    s.halted = true;
-    return memory_changed(false, 0);
-}
+    // Runs every lane's due events through its own state; returns the
+    // step to look again
+    unsigned long long run_events(unsigned long long steps)
+    {
+        fold();
+        unsigned long long next = ~0ULL;
+        for(size_t i = 0; i < lanes.size(); i++) {
+            if(!active[i])
+                continue;
+            state& s = lanes[i]->s;
+            to_state(i);
+            s.run_events();
+            from_state(i);
+            if(s.halted || s.memory_fault)
+                active[i] = 0;
+            else
+                next = std::min(next, next_event(i, steps));
+        }
+        return next;
+    }
 
-memory_changed swapcc(state& s, const instruction& instr)
-{
-    int32_t t = s.registers[instr.dst];
+    // Whether the vector kernel handles instr; anything reading or writing
+    // PC as a register goes lane by lane
+    static bool vectorizable(const instruction& instr)
+    {
+        switch(instr.opcode) {
+            case opcode::AND: case opcode::OR: case opcode::XOR: case opcode::NOT:
+            case opcode::ADD: case opcode::SUB: case opcode::MOV: case opcode::CMP:
+                return instr.dst != reg::PC && instr.src != reg::PC;
+            case opcode::MOVIU: case opcode::ADDI: case opcode::ADDIU:
+            case opcode::CMPIU: case opcode::SHIFT: case opcode::JSR:
+                return instr.dst != reg::PC;
+            case opcode::JMP: case opcode::JNE: case opcode::JL:
+                return true;
+        }
+        return false;
+    }
 
-    s.registers[instr.dst] =
-        ((s.carry ? 1 : 0) << 3) |
-        ((s.lt ? 1 : 0) << 2) |
-        ((s.gt ? 1 : 0) << 1) |
-        ((s.eq ? 1 : 0) << 0);
+    // Lowest PC among running lanes and the first lane there; false once
+    // every lane has stopped
+    bool lowest_pc(uint32_t *pc, size_t *first)
+    {
+        uint32_t lowest = 0xffffffff;
+        bool any = false;
+        const int32_t *pcs = column(reg::PC);
+        for(size_t i = 0; i < lanes.size(); i++)
+            if(active[i] && (!any || (uint32_t)pcs[i] < lowest)) {
+                lowest = pcs[i];
+                *first = i;
+                any = true;
+            }
+        *pc = lowest;
+        return any;
+    }
 
-    s.carry = (t & 0x8) ? 1 : 0;
-    s.lt = t & 0x4;
-    s.gt = t & 0x2;
-    s.eq = t & 0x1;
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    bool lowest_pc_avx2(uint32_t *pc, size_t *first)
+    {
+        const int32_t *pcs = column(reg::PC);
+        const __m256i ones = _mm256_set1_epi32(-1);
+        __m256i lowest = ones;
+        __m256i any = _mm256_setzero_si256();
+        for(size_t v = 0; v < count; v += lockstep_width) {
+            __m256i running = _mm256_loadu_si256((const __m256i *)&active[v]);
+            __m256i p = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)&pcs[v]), _mm256_andnot_si256(running, ones));
+            lowest = _mm256_min_epu32(lowest, p);
+            any = _mm256_or_si256(any, running);
+        }
+        if(_mm256_testz_si256(any, any))
+            return false;
+
+        uint32_t lanes_min[lockstep_width];
+        _mm256_storeu_si256((__m256i *)lanes_min, lowest);
+        *pc = *std::min_element(lanes_min, lanes_min + lockstep_width);
+
+        const __m256i target = _mm256_set1_epi32(*pc);
+        for(size_t v = 0; v < count; v += lockstep_width) {
+            __m256i at = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&active[v]),
+                _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&pcs[v]), target));
+            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(at));
+            if(bits != 0) {
+                *first = v + __builtin_ctz(bits);
+                break;
+            }
+        }
+        return true;
+    }
 
-    s.registers[reg::PC] += 4;
-    return memory_changed(false, 0);
-}
+    // Executes instr on every running lane at pc; instr must be vectorizable()
+    __attribute__((target("avx2")))
+    void step_avx2(const instruction& instr, uint32_t pc)
+    {
+        int32_t *pcs = column(reg::PC);
+        int32_t *dst = column(instr.dst);
+        int32_t *src = column(instr.src);
+        const __m256i target = _mm256_set1_epi32(pc);
+        const __m256i four = _mm256_set1_epi32(4);
+        const __m256i ones = _mm256_set1_epi32(-1);
+        const __m128i amount = _mm_cvtsi32_si128(instr.data & 0x1f);
+
+        __m256i imm;
+        switch(instr.opcode) {
+            case opcode::MOVIU: imm = _mm256_set1_epi32(instr.data << 16); break;
+            case opcode::ADDI: imm = _mm256_set1_epi32(instr.imm); break;
+            case opcode::ADDIU: case opcode::CMPIU: imm = _mm256_set1_epi32(instr.data); break;
+            default: imm = _mm256_set1_epi32(instr.imm << 2); break; // branch offset or JMP target
+        }
 
-opcode_info opcodes[] =
-{
-    [opcode::MOVIU] = {24, "moviu", moviu},
-    [opcode::ADDI] = {24, "addi", addi},
-    [opcode::SHIFT] = {18, "shift", shift},
-    [opcode::CMPIU] = {24, "cmpiu", cmpiu},
-    [opcode::ADDIU] = {24, "addiu", addiu},
-
-    [opcode::STORE] = {18, "store", store},
-    [opcode::LOAD] = {18, "load", load},
-    [opcode::MOV] = {18, "mov", mov},
-    [opcode::PUSH] = {24, "push", push},
-    [opcode::POP] = {24, "pop", pop},
-
-    [opcode::AND] = {18, "and", op_and},
-    [opcode::OR] = {18, "or", op_or},
-    [opcode::XOR] = {18, "xor", op_xor},
-    [opcode::NOT] = {18, "not", op_not},
-    [opcode::ADD] = {18, "add", add},
-    [opcode::ADC] = {18, "adc", adc},
-    [opcode::SUB] = {18, "sub", sub},
-    [opcode::MULT] = {18, "mult", mult},
-    [opcode::DIV] = {18, "div", div},
-    [opcode::CMP] = {18, "cmp", cmp},
-    [opcode::XCHG] = {18, "xchg", xchg},
-
-    [opcode::JNE] = {27, "jne", jne},
-    [opcode::JL] = {27, "jl", jl},
-    [opcode::JSR] = {27, "jsr", jsr},
-    [opcode::JMP] = {27, "jmp", jmp},
-    [opcode::JR] = {24, "jr", jr},
-    [opcode::SWAPCC] = {24, "swapcc", swapcc},
-
-    [opcode::SYS] = {6, "sys", sys}, // 6 bits is special case
-    [opcode::HALT] = {27, "halt", halt},
-};
+        bool writes_dst = true;
+        bool writes_flags = false;
+        switch(instr.opcode) {
+            case opcode::CMP: case opcode::CMPIU:
+                writes_flags = true;
+                // fall through
+            case opcode::JMP: case opcode::JNE: case opcode::JL:
+                writes_dst = false;
+                break;
+        }
 
-instruction::instruction(uint32_t value)
-{
-    opcode = (value >> 27);
-    dst = (value >> 24) & 0x7;
-    src = (value >> 21) & 0x7;
-    modifier = (value >> 18) & 0x7;
-    data = value & maskbits(opcodes[opcode].datasize);
-}
+        for(size_t v = 0; v < count; v += lockstep_width) {
+            __m256i p = _mm256_loadu_si256((const __m256i *)&pcs[v]);
+            __m256i mask = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&active[v]), _mm256_cmpeq_epi32(p, target));
+            if(_mm256_testz_si256(mask, mask))
+                continue;
+
+            __m256i d = _mm256_loadu_si256((const __m256i *)&dst[v]);
+            __m256i s = _mm256_loadu_si256((const __m256i *)&src[v]);
+            __m256i result = d;
+            __m256i next = _mm256_add_epi32(p, four);
+            __m256i e = d, l = d, g = d;
+
+            switch(instr.opcode) {
+                case opcode::MOVIU: result = imm; break;
+                case opcode::ADDI: case opcode::ADDIU: result = _mm256_add_epi32(d, imm); break;
+                case opcode::SHIFT:
+                    // RL and RA are both arithmetic since registers are signed
+                    // and modifiers past LA change nothing, as in shift()
+                    if(instr.modifier == shifttype::RL || instr.modifier == shifttype::RA)
+                        result = _mm256_sra_epi32(d, amount);
+                    else if(instr.modifier == shifttype::LL || instr.modifier == shifttype::LA)
+                        result = _mm256_sll_epi32(d, amount);
+                    break;
+                case opcode::MOV: result = s; break;
+                case opcode::NOT: result = _mm256_xor_si256(s, ones); break;
+                case opcode::AND: result = _mm256_and_si256(d, s); break;
+                case opcode::OR: result = _mm256_or_si256(d, s); break;
+                case opcode::XOR: result = _mm256_xor_si256(d, s); break;
+                case opcode::ADD: result = _mm256_add_epi32(d, s); break;
+                case opcode::SUB: result = _mm256_sub_epi32(d, s); break;
+                case opcode::CMP:
+                    e = _mm256_cmpeq_epi32(d, s);
+                    l = _mm256_cmpgt_epi32(s, d);
+                    g = _mm256_cmpgt_epi32(d, s);
+                    break;
+                case opcode::CMPIU:
+                    // both sides fit in 24 bits, so a signed compare is unsigned
+                    d = _mm256_and_si256(d, _mm256_set1_epi32(0xffffff));
+                    e = _mm256_cmpeq_epi32(d, imm);
+                    l = _mm256_cmpgt_epi32(imm, d);
+                    g = _mm256_cmpgt_epi32(d, imm);
+                    break;
+                case opcode::JMP: next = imm; break;
+                case opcode::JNE:
+                    next = _mm256_blendv_epi8(_mm256_add_epi32(p, imm), next, _mm256_loadu_si256((const __m256i *)&eq[v]));
+                    break;
+                case opcode::JL:
+                    next = _mm256_blendv_epi8(next, _mm256_add_epi32(p, imm), _mm256_loadu_si256((const __m256i *)&lt[v]));
+                    break;
+                case opcode::JSR:
+                    result = next;
+                    next = _mm256_add_epi32(p, imm);
+                    break;
+            }
 
-state s;
+            if(writes_dst)
+                _mm256_storeu_si256((__m256i *)&dst[v], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *)&dst[v]), result, mask));
+            if(writes_flags) {
+                _mm256_storeu_si256((__m256i *)&eq[v], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *)&eq[v]), e, mask));
+                _mm256_storeu_si256((__m256i *)&lt[v], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *)&lt[v]), l, mask));
+                _mm256_storeu_si256((__m256i *)&gt[v], _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *)&gt[v]), g, mask));
+            }
+            _mm256_storeu_si256((__m256i *)&pcs[v], _mm256_blendv_epi8(p, next, mask));
+            // mask is -1 per stepped lane
+            _mm256_storeu_si256((__m256i *)&counts[v], _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)&counts[v]), mask));
+        }
+    }
+#endif
 
-namespace po = boost::program_options;
+    // Steps every lane until all have halted or faulted, or for "limit"
+    // steps; no lane runs more instructions than there are steps
+    void run(unsigned long long limit)
+    {
+        // counts[] are 32 bits and grow by at most one per step
+        const unsigned long long fold_interval = 1ULL << 30;
+
+        unsigned long long due = run_events(0);
+        for(unsigned long long steps = 0; steps < limit; steps++) {
+            if(steps >= due)
+                due = run_events(steps);
+
+            uint32_t pc;
+            size_t first = 0;
+#if defined(__x86_64__)
+            bool running = use_avx2 ? lowest_pc_avx2(&pc, &first) : lowest_pc(&pc, &first);
+#else
+            bool running = lowest_pc(&pc, &first);
+#endif
+            if(!running)
+                break;
+
+            state& leader = lanes[first]->s;
+            const decoded_instruction& d = leader.decode(pc);
+#if defined(__x86_64__)
+            if(use_avx2 && !leader.memory_fault && vectorizable(d.instr)) {
+                step_avx2(d.instr, pc);
+                if(steps % fold_interval == fold_interval - 1)
+                    fold();
+                continue;
+            }
+#endif
+            leader.memory_fault = false; // the lane takes its own fault below
+            const int32_t *pcs = column(reg::PC);
+            for(size_t i = first; i < lanes.size(); i++)
+                if(active[i] && (uint32_t)pcs[i] == pc) {
+                    step_lane(i); // may start a timer or a disk transfer
+                    due = std::min(due, next_event(i, steps + 1));
+                }
+        }
+        fold();
 
-enum VerbosityLevel {
-    ERROR = 0,
-    WARNING = 1,
-    INFO = 2,
-    DEBUG = 3,
+        for(size_t i = 0; i < lanes.size(); i++) {
+            to_state(i);
+            lanes[i]->console.flush();
+        }
+    }
 };
 
 int main(int argc, char **argv)
 {
-    int verbosity = 0;
-    unsigned long long instructions = 0;
-    bool harvard = false;
-    const int programsize = 128 * 1024;
-    uint32_t *program;
+    sim_options options;
+    std::string console_flush;
+    std::string image_name;
+    std::string batch_name;
+    std::string lockstep_name;
+    std::string resume_name;
+    std::string save_name;
+    std::string gdb_address;
+    unsigned int jobs = std::thread::hardware_concurrency();
 
     po::options_description desc("Simulator options");
     desc.add_options()
         ("help", "produce help message")
-        ("verbose", po::value<int>(&verbosity)->default_value(VerbosityLevel::ERROR), "set verbosity level")
-        ("harvard", po::value(&harvard)->zero_tokens(), "use Harvard architecture (instructions separate from RAM)")
+        ("image", po::value<std::string>(&image_name), "BIN file to map copy-on-write at address 0, or a segmented image from \"asm -s\" (default: read from stdin)")
+        ("verbose", po::value<int>(&options.verbosity)->default_value(VerbosityLevel::ERROR), "set verbosity level")
+        ("harvard", po::value(&options.harvard)->zero_tokens(), "use Harvard architecture (instructions separate from RAM)")
+        ("hypercalls", po::value(&options.hypercalls)->zero_tokens(), "run SYS 0x3c-0x3f (memcpy, memset, memcmp and CRC-32 on R0-R2) on the host instead of vectoring")
+        ("exceptions", po::value(&options.exceptions)->zero_tokens(), "run the guest's handlers at 0x4, 0x8 and 0xc for illegal instructions, unaligned accesses and bad addresses instead of stopping")
+        ("disk", po::value<std::string>(&options.disk_name), "attach this file as a DMA block device at 0xf0002000, writing changes back to it")
+        ("disk-latency", po::value<unsigned int>(&options.disk_latency), "instructions from a disk command to its completion (default 1000)")
+        ("memory", po::value<uint64_t>(&options.memory_mib), "MiB of RAM from address 0, allocated as touched (default 4096, the whole address space)")
+        ("threaded", po::value(&options.threaded)->zero_tokens(), "use the computed-goto interpreter core (ignored with --verbose 3, --trace, --profile-stacks or --timing)")
+        ("no-fusion", po::value(&options.no_fusion)->zero_tokens(), "don't execute common instruction pairs as one operation")
+        ("jit", po::value(&options.use_jit)->zero_tokens(), "translate basic blocks to x86-64 code (ignored with --verbose 3, --trace, --profile-stacks or --timing)")
+        ("console-fd", po::value<int>(&options.console_fd), "write guest console output to this file descriptor (default stdout)")
+        ("console-flush", po::value<std::string>(&console_flush), "console flush policy: newline, size or halt (default newline on a terminal, otherwise size)")
+        ("console-buffer", po::value<size_t>(&options.console_buffer), "console buffer size in bytes (default 65536)")
+        ("max-instructions", po::value<unsigned long long>(&options.max_instructions), "stop after about this many instructions (the JIT checks once per block)")
+        ("batch", po::value<std::string>(&batch_name), "run every BIN file listed one per line in this file and print a JSON summary line for each")
+        ("jobs", po::value<unsigned int>(&jobs), "threads for --batch (default one per CPU)")
+        ("resume", po::value<std::string>(&resume_name), "start from a snapshot file instead of an image (with --harvard, the image is still the program)")
+        ("trace", po::value<std::string>(&options.trace_name), "record every instruction's PC, register writes and stores to this binary trace file (read it with simtrace)")
+        ("trace-compress", po::value(&options.trace_compress)->zero_tokens(), "zlib-compress the trace")
+        ("profile", po::value<std::string>(&options.profile_name), "count instructions per PC and opcode and write a hot-spot report to this file")
+        ("profile-stacks", po::value<std::string>(&options.stacks_name), "write call stacks rebuilt from JSR/JR to this file in flame graph collapsed format")
+        ("profile-top", po::value<size_t>(&options.profile_top), "PCs and blocks listed in the --profile report (default 50)")
+        ("timing", po::value(&options.timing)->zero_tokens(), "run the cycle-approximate timing model and report cycles, CPI and cache hit rates")
+        ("icache", po::value<std::string>(&options.icache), "timing model I-cache as SIZE:LINE:WAYS in bytes, or 0 for none (default 4096:16:1)")
+        ("dcache", po::value<std::string>(&options.dcache), "timing model D-cache as SIZE:LINE:WAYS in bytes, or 0 for none (default 4096:16:1)")
+        ("memory-latency", po::value<unsigned int>(&options.memory_latency), "timing model cycles per cache miss (default 10)")
+        ("branch-penalty", po::value<unsigned int>(&options.branch_penalty), "timing model cycles lost to a taken JNE/JL or a JR (default 2)")
+        ("gdb", po::value<std::string>(&gdb_address), "wait for a GDB remote debugger on this TCP port (on 127.0.0.1) or Unix socket path before running")
+        ("save-snapshot", po::value<std::string>(&save_name), "write a snapshot file once the run stops, e.g. at --max-instructions")
+        ("lockstep", po::value<std::string>(&lockstep_name), "run the image once per line of this file, in lockstep; each line holds initial R0, R1, ... and a JSON summary line is printed per lane")
     ;
 
+    po::positional_options_description positional;
+    positional.add("image", 1);
+
     po::variables_map vm;
-    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
     po::notify(vm);    
 
     if (vm.count("help")) {
@@ -495,70 +914,156 @@ int main(int argc, char **argv)
         exit(EXIT_SUCCESS);
     }
 
-    if(harvard) {
+    options.console_policy = isatty(options.console_fd) ? console_device::FLUSH_NEWLINE : console_device::FLUSH_SIZE;
+    if(console_flush == "newline")
+        options.console_policy = console_device::FLUSH_NEWLINE;
+    else if(console_flush == "size")
+        options.console_policy = console_device::FLUSH_SIZE;
+    else if(console_flush == "halt")
+        options.console_policy = console_device::FLUSH_HALT;
+    else if(!console_flush.empty()) {
+        std::cerr << "unknown console flush policy \"" << console_flush << "\"" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-        program = new uint32_t[programsize];
-        uint32_t addr = 0;
-        while(fread(&program[addr], 4, 1, stdin) == 1) {
-            addr++;
+    if(!batch_name.empty()) {
+        std::ifstream list(batch_name.c_str());
+        if(!list) {
+            std::cerr << "couldn't open " << batch_name << std::endl;
+            exit(EXIT_FAILURE);
         }
+        std::vector<std::string> images;
+        std::string line;
+        while(std::getline(list, line))
+            if(!line.empty())
+                images.push_back(line);
+
+        // console output goes into the summaries and tracing is per-run only
+        options.console_fd = -1;
+        options.console_policy = console_device::FLUSH_HALT;
+        options.verbosity = std::min(options.verbosity, (int)VerbosityLevel::INFO);
+        options.trace_name.clear();
+        options.profile_name.clear();
+        options.stacks_name.clear();
+        options.timing = false;
+        options.disk_name.clear(); // one image can't be shared by many guests
+        run_batch(options, images, jobs);
+        exit(EXIT_SUCCESS);
+    }
 
-    } else {
-
-        uint32_t addr = 0;
-        uint32_t d;
-        while(fread(&d, 4, 1, stdin) == 1) {
-            s.store32(addr, d);
-            addr += 4;
+    if((options.use_jit || options.threaded) && options.stepping())
+        std::cerr << "--verbose 3, --trace, --profile-stacks and --timing step every instruction; ignoring "
+            << (options.use_jit ? "--jit" : "--threaded") << std::endl;
+
+    uint8_t *image = NULL;
+    size_t imagesize = 0;
+    std::vector<uint8_t> stdin_image;
+
+    // a snapshot holds all of RAM, so only a Harvard program is loaded too
+    if(!resume_name.empty() && !options.harvard) {
+        // nothing to load
+    } else if(!image_name.empty()) {
+        image = map_image(image_name.c_str(), &imagesize);
+        if(image == NULL) {
+            std::cerr << "couldn't map " << image_name << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
         }
+    } else {
+        stdin_image = read_image(stdin);
+        image = stdin_image.data();
+        imagesize = stdin_image.size();
     }
 
-    while(!s.halted) {
-        uint32_t pc = s.registers[reg::PC];
-        uint32_t word = harvard ? program[pc / 4] : s.fetch32(pc);
-        instruction instr(word);
-
-        if(s.memory_fault) {
-            printf("memory fault at 0x%08X\n", s.fault_address);
-            continue;
+    if(!lockstep_name.empty()) {
+        if(!options.disk_name.empty()) {
+            std::cerr << "--disk can't be used with --lockstep; one image can't be shared by many lanes" << std::endl;
+            exit(EXIT_FAILURE);
         }
-
-        if(verbosity >= VerbosityLevel::DEBUG) {
-            printf("decoded %s", opcodes[instr.opcode].name);
-            if(opcodes[instr.opcode].datasize == 18) {
-                printf(", dst = %d, src = %d, size = %d, data = 0x%X\n", instr.dst, instr.src, instr.modifier, instr.data);
-            } else if(opcodes[instr.opcode].datasize == 24) {
-                printf(", dst = %d, src = %d, data = 0x%X\n", instr.dst, instr.src, instr.data);
-            } else /* if(opcodes[instr.opcode].datasize == 27) or 6 */ {
-                printf(", dst = %d, data = 0x%X\n", instr.dst, instr.data);
-            }
+        std::ifstream list(lockstep_name.c_str());
+        if(!list) {
+            std::cerr << "couldn't open " << lockstep_name << std::endl;
+            exit(EXIT_FAILURE);
         }
-
-        memory_changed change = opcodes[instr.opcode].func(s, instr);
-        if(s.memory_fault) {
-            printf("memory fault at 0x%08X\n", s.fault_address);
-            continue;
+        options.console_fd = -1;
+        options.console_policy = console_device::FLUSH_HALT;
+
+        std::vector<simulator *> lanes;
+        std::vector<uint8_t *> lane_images;
+        std::string line;
+        while(std::getline(list, line)) {
+            if(line.empty())
+                continue;
+            simulator *sim = new simulator(options);
+            // each lane needs its own private mapping to keep its stores
+            uint8_t *lane_image = image;
+            if(!image_name.empty() && lanes.size() > 0 && !options.harvard) {
+                lane_image = map_image(image_name.c_str(), &imagesize);
+                if(lane_image == NULL) {
+                    std::cerr << "couldn't map " << image_name << ": " << strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                lane_images.push_back(lane_image);
+            }
+            if(!sim->load(lane_image, imagesize, !image_name.empty())) {
+                std::cerr << "malformed segmented image, or a segment outside RAM" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::istringstream values(line);
+            std::string value;
+            for(int r = 0; r < registercount && values >> value; r++)
+                sim->s.registers[r] = strtoul(value.c_str(), NULL, 0);
+            lanes.push_back(sim);
         }
-        instructions++;
 
-        if(verbosity >= VerbosityLevel::DEBUG) {
-            printf("R0:%08X R1:%08X R2:%08X R3:%08X\n",
-                s.registers[0], s.registers[1], s.registers[2], s.registers[3]);
-            printf("R4:%08X R5:%08X SP:%08X PC:%08X\n", 
-                s.registers[4], s.registers[5], s.registers[6], s.registers[7]);
+        lockstep(lanes).run(options.max_instructions);
 
-            // hack not to trigger memory fault
-            if(change.first && change.second <= (memsize - 4)) {
-                printf("memory changed %08x : %08X\n", change.second, s.fetch32(change.second));
-            }
+        for(size_t i = 0; i < lanes.size(); i++) {
+            printf("%s\n", json_summary("{\"lane\":" + std::to_string(i), *lanes[i]).c_str());
+            delete lanes[i];
         }
-    };
+        for(size_t i = 0; i < lane_images.size(); i++)
+            munmap(lane_images[i], std::max(imagesize, (size_t)1));
+        exit(EXIT_SUCCESS);
+    }
 
-    if(verbosity >= VerbosityLevel::INFO) {
-        printf("R0:%08X R1:%08X R2:%08X R3:%08X\n",
-            s.registers[0], s.registers[1], s.registers[2], s.registers[3]);
-        printf("R4:%08X R5:%08X SP:%08X PC:%08X\n", 
-            s.registers[4], s.registers[5], s.registers[6], s.registers[7]);
-        printf("%llu instructions executed\n", instructions);
+    std::unique_ptr<simulator> sim(new simulator(options));
+    if((image != NULL || options.harvard) && !sim->load(image, imagesize, !image_name.empty())) {
+        std::cerr << "malformed segmented image, or a segment outside RAM" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(!options.disk_name.empty() && !sim->attach_disk()) {
+        std::cerr << "couldn't map disk image " << options.disk_name << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(!resume_name.empty()) {
+        const char *error = read_snapshot(sim->s, resume_name.c_str());
+        if(error != NULL) {
+            std::cerr << "couldn't resume from " << resume_name << ": " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(!options.trace_name.empty() && !sim->start_trace()) {
+        std::cerr << "couldn't write trace " << options.trace_name << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    sim->start_profile();
+    if(!sim->start_timing()) {
+        std::cerr << "cache sizes are SIZE:LINE:WAYS with power-of-two sets and lines of at least 4 bytes" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(!gdb_address.empty()) {
+        gdb_server server(*sim);
+        if(!server.accept_connection(gdb_address)) {
+            std::cerr << "couldn't accept a gdb connection on " << gdb_address << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(!server.serve())
+            exit(EXIT_SUCCESS);
+    }
+    sim->run();
+    sim->print_report();
+    if(!save_name.empty() && !sim->save(save_name.c_str())) {
+        std::cerr << "couldn't write snapshot " << save_name << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
     }
 }
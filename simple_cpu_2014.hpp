@@ -143,6 +143,84 @@ namespace shifttype {
     const uint LA = 3;
 };
 
+namespace mmio {
+    const uint32_t CONSOLE_OUTPUT = 0xf0000000; // byte store prints it
+    const uint32_t CONSOLE_STRING_ADDRESS = 0xf0000004;
+    const uint32_t CONSOLE_STRING_LENGTH = 0xf0000008; // store prints that many bytes from STRING_ADDRESS
+
+    const uint32_t TIMER_PERIOD = 0xf0001000; // instructions between ticks, 0 stops the timer
+    const uint32_t TIMER_COUNT = 0xf0001004; // instructions executed, low 32 bits
+    const uint32_t INTERRUPT_PENDING = 0xf0001008; // interrupt:: lines raised; store 1s to acknowledge
+    const uint32_t INTERRUPT_ENABLE = 0xf000100c; // interrupt:: lines that may interrupt
+    const uint32_t INTERRUPT_CONTROL = 0xf0001010; // 1 to take interrupts, cleared when one is taken
+
+    const uint32_t DISK_SECTOR = 0xf0002000; // first sector of the next transfer
+    const uint32_t DISK_ADDRESS = 0xf0002004; // guest RAM address of the next transfer
+    const uint32_t DISK_COUNT = 0xf0002008; // sectors in the next transfer
+    const uint32_t DISK_COMMAND = 0xf000200c; // disk::READ or WRITE starts a transfer
+    const uint32_t DISK_STATUS = 0xf0002010; // disk::IDLE, BUSY, DONE or ERROR
+    const uint32_t DISK_SECTORS = 0xf0002014; // disk size in sectors
+};
+
+namespace disk {
+    const uint32_t SECTOR_SIZE = 512;
+
+    const uint32_t READ = 1; // disk to RAM
+    const uint32_t WRITE = 2; // RAM to disk
+
+    const uint32_t IDLE = 0;
+    const uint32_t BUSY = 1;
+    const uint32_t DONE = 2;
+    const uint32_t ERROR = 3;
+};
+
+// An interrupt stores PC - 4 at SP - 4, moves SP down and jumps to
+// vectors::INTERRUPT.  "pop pc" adds 4 to what it loads, so it resumes at
+// the interrupted PC.  After a taken branch PC - 4 is not the instruction
+// that just ran, and SYS stores at the address in R2, not SP - 4.
+namespace interrupt {
+    const uint32_t TIMER = 0x1;
+    const uint32_t DISK = 0x2; // a transfer finished
+};
+
+// SYS vectors "sim --hypercalls" handles itself, with arguments in R0-R2
+// and the result in R0; other programs may use them as ordinary vectors
+namespace hypercall {
+    const uint32_t FIRST = 0x3c;
+    const uint32_t MEMCPY = 0x3c; // R0 = dst, R1 = src, R2 = bytes; may overlap
+    const uint32_t MEMSET = 0x3d; // R0 = dst, R1 = byte, R2 = bytes
+    const uint32_t MEMCMP = 0x3e; // R0 = a, R1 = b, R2 = bytes; R0 = -1, 0 or 1
+    const uint32_t CRC32 = 0x3f; // R0 = address, R1 = CRC so far (0 to start), R2 = bytes; R0 = CRC-32
+};
+
+namespace vectors {
+    const uint32_t RESET = 0x0;
+    const uint32_t ILLEGAL = 0x4;
+    const uint32_t UNALIGNED = 0x8;
+    const uint32_t BAD_ACCESS = 0xc;
+    const uint32_t INTERRUPT = 0x10;
+};
+
+// Segmented image, as "asm -s" writes: a header, a table of entries, then
+// each segment's bytes.  Addresses, sizes and file offsets are multiples
+// of ALIGN, so a loader can map every segment straight from the file.
+namespace segment {
+    const char MAGIC[8] = {'S', 'C', 'P', 'U', 'S', 'E', 'G', '1'};
+    const uint32_t ALIGN = 4096;
+
+    struct header {
+        char magic[8];
+        uint32_t count; // entries following the header
+        uint32_t reserved;
+    };
+
+    struct entry {
+        uint32_t address;
+        uint32_t size;
+        uint64_t offset; // from the start of the file
+    };
+};
+
 namespace reg {
     const uint R0 = 0;
     const uint R1 = 1;
@@ -0,0 +1,118 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+#include "simple_cpu_2014.hpp"
+#include "trace.hpp"
+
+// Streams a binary trace written by "sim --trace", printing the records
+// that pass every filter given, one line each:
+//
+//   index PC [Rn=value ...] [[address]=value]
+
+namespace po = boost::program_options;
+
+using namespace simple_cpu_2014;
+
+const char *register_names[] = {"R0", "R1", "R2", "R3", "R4", "R5", "SP", "PC"};
+
+// "first" or "first:last", in any base strtoul() accepts
+bool parse_range(const std::string& text, uint32_t *first, uint32_t *last)
+{
+    char *end;
+    *first = strtoul(text.c_str(), &end, 0);
+    *last = *first;
+    if(*end == ':')
+        *last = strtoul(end + 1, &end, 0);
+    return *end == '\0' && *first <= *last;
+}
+
+int main(int argc, char **argv)
+{
+    std::string trace_name;
+    unsigned long long from = 0;
+    unsigned long long to = ~0ULL;
+    std::string pc_range;
+    std::string address_range;
+    int written = -1;
+    bool stores = false;
+    bool count = false;
+
+    po::options_description desc("Trace reader options");
+    desc.add_options()
+        ("help", "produce help message")
+        ("trace", po::value<std::string>(&trace_name), "trace file written by sim --trace")
+        ("from", po::value<unsigned long long>(&from), "skip records before this instruction index")
+        ("to", po::value<unsigned long long>(&to), "stop after this instruction index")
+        ("pc", po::value<std::string>(&pc_range), "only instructions at this PC or FIRST:LAST range")
+        ("address", po::value<std::string>(&address_range), "only stores to this address or FIRST:LAST range")
+        ("stores", po::value(&stores)->zero_tokens(), "only instructions that store")
+        ("register", po::value<int>(&written), "only instructions that change this register (0-6)")
+        ("count", po::value(&count)->zero_tokens(), "print only the number of matching records")
+    ;
+
+    po::positional_options_description positional;
+    positional.add("trace", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);    
+
+    if (vm.count("help") || trace_name.empty()) {
+        std::cout << desc << "\n";
+        exit(vm.count("help") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    uint32_t pc_first = 0, pc_last = 0xffffffff;
+    uint32_t address_first = 0, address_last = 0xffffffff;
+    if((!pc_range.empty() && !parse_range(pc_range, &pc_first, &pc_last)) ||
+        (!address_range.empty() && !parse_range(address_range, &address_first, &address_last))) {
+        std::cerr << "ranges are ADDRESS or FIRST:LAST" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(!address_range.empty())
+        stores = true;
+
+    trace::reader reader;
+    if(!reader.open(trace_name.c_str())) {
+        std::cerr << "couldn't read " << trace_name << ": " << (reader.error ? reader.error : strerror(errno)) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long matched = 0;
+    const trace::record& r = reader.current;
+    while(reader.next() && r.index <= to) {
+        if(r.index < from || r.pc < pc_first || r.pc > pc_last)
+            continue;
+        if(stores && (!r.stored || r.store_address < address_first || r.store_address > address_last))
+            continue;
+        if(written >= 0 && !(r.written & (1 << written)))
+            continue;
+
+        matched++;
+        if(count)
+            continue;
+
+        printf("%llu %08X", r.index, r.pc);
+        for(uint i = 0; i < reg::PC; i++)
+            if(r.written & (1 << i))
+                printf(" %s=%08X", register_names[i], r.registers[i]);
+        if(r.stored) {
+            if(r.has_value)
+                printf(" [%08X]=%08X", r.store_address, r.store_value);
+            else
+                printf(" [%08X]", r.store_address);
+        }
+        printf("\n");
+    }
+
+    if(reader.error != NULL) {
+        std::cerr << trace_name << ": " << reader.error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(count)
+        printf("%llu\n", matched);
+}
@@ -0,0 +1,701 @@
+#include "simulator.hpp"
+
+uint8_t zero_page[page_size];
+page_table make_zero_table()
+{
+    page_table t = page_table();
+    for(uint32_t i = 0; i < l2_entries; i++)
+        t.read[i] = zero_page;
+    return t;
+}
+
+page_table hole_table; // every page unmapped
+page_table zero_table = make_zero_table(); // every page RAM that hasn't been written yet
+
+uint32_t state::fetch_instruction(uint32_t pc)
+{
+    if(!separate_instructions) {
+        // only RAM holds code: reading a device register could have side
+        // effects, and decode() would cache its value as an instruction
+        if(!is_ram(pc, 4)) {
+            fault(pc);
+            return 0;
+        }
+        return fetch32(pc);
+    }
+
+    if(pc / 4 >= programsize) {
+        fault(pc);
+        return 0;
+    }
+    return program[pc / 4];
+}
+
+// Like fetch_instruction() but never faults or touches a device
+bool state::peek_instruction(uint32_t pc, uint32_t *word)
+{
+    if(separate_instructions) {
+        if(pc / 4 >= programsize)
+            return false;
+        *word = program[pc / 4];
+        return true;
+    }
+    if(!is_ram(pc, 4))
+        return false;
+    *word = fetch32(pc);
+    return true;
+}
+
+inline memory_changed moviu(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] = instr.data << 16;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed addi(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] += instr.imm;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed addiu(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] += instr.data;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed shift(state& s, const instruction& instr)
+{
+    if(instr.modifier == shifttype::RL)
+        s.registers[instr.dst] >>= (instr.data & 0x1f);
+    else if(instr.modifier == shifttype::LL)
+        s.registers[instr.dst] <<= (instr.data & 0x1f);
+    else if(instr.modifier == shifttype::RA)
+        s.registers[instr.dst] = s.registers[instr.dst] >> (instr.data & 0x1f);
+    else if(instr.modifier == shifttype::LA)
+        s.registers[instr.dst] = s.registers[instr.dst] << (instr.data & 0x1f);
+
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed cmpiu(state& s, const instruction& instr)
+{
+    s.eq = (((uint32_t)s.registers[instr.dst] & 0xffffff) == instr.data);
+    s.lt = (((uint32_t)s.registers[instr.dst] & 0xffffff) < instr.data);
+    s.gt = (((uint32_t)s.registers[instr.dst] & 0xffffff) > instr.data);
+
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed store(state& s, const instruction& instr)
+{
+    uint32_t addr = s.registers[instr.dst] + instr.imm;
+    switch(instr.modifier) {
+        case opsize::SIZE_8: s.store8(addr, s.registers[instr.src]); break;
+        case opsize::SIZE_16: s.store16(addr, s.registers[instr.src]); break;
+        case opsize::SIZE_32: s.store32(addr, s.registers[instr.src]); break;
+    }
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[reg::PC] += 4;
+    return memory_changed(true, addr);
+}
+
+inline memory_changed load(state& s, const instruction& instr)
+{
+    uint32_t addr = s.registers[instr.src] + instr.imm;
+    uint32_t data = 0xffffffff;
+    switch(instr.modifier) {
+        case opsize::SIZE_8: data = s.fetch8(addr); break;
+        case opsize::SIZE_16: data = s.fetch16(addr); break;
+        case opsize::SIZE_32: data = s.fetch32(addr); break;
+    }
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[instr.dst] = data;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed mov(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] = s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed push(state& s, const instruction& instr)
+{
+    s.store32(s.registers[reg::SP - 4], s.registers[instr.dst]); // dst is first reg
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[reg::SP] -= 4;
+    s.registers[reg::PC] += 4;
+    return memory_changed(true, s.registers[reg::SP]);
+}
+
+inline memory_changed pop(state& s, const instruction& instr)
+{
+    uint32_t data = s.fetch32(s.registers[reg::SP]);
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[instr.dst] = data;
+    s.registers[reg::SP] += 4;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed op_and(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] &= s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed op_or(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] |= s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed op_xor(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] ^= s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed op_not(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] = ~s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed add(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] += s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    // XXX carry
+    return memory_changed(false, 0);
+}
+
+inline memory_changed adc(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] += s.registers[instr.src] + s.carry;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed sub(state& s, const instruction& instr)
+{
+    s.registers[instr.dst] -= s.registers[instr.src];
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed mult(state& s, const instruction& instr)
+{
+    long long v = s.registers[instr.dst] * s.registers[instr.src];
+    s.registers[instr.dst] = v >> 32;
+    s.registers[instr.src] = v & 0xffffffff;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed div(state& s, const instruction& instr)
+{
+    int32_t d = s.registers[instr.dst] / s.registers[instr.src];
+    int32_t m = s.registers[instr.dst] % s.registers[instr.src];
+    s.registers[instr.dst] = d;
+    s.registers[instr.src] = m;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed cmp(state& s, const instruction& instr)
+{
+    s.eq = (s.registers[instr.dst] == s.registers[instr.src]);
+    s.lt = (s.registers[instr.dst] < s.registers[instr.src]);
+    s.gt = (s.registers[instr.dst] > s.registers[instr.src]);
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed xchg(state& s, const instruction& instr)
+{
+    int32_t t = s.registers[instr.dst];
+    s.registers[instr.dst] = s.registers[instr.src];
+    s.registers[instr.src] = t;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed jne(state& s, const instruction& instr)
+{
+    if(s.eq)
+        s.registers[reg::PC] += 4;
+    else
+        s.registers[reg::PC] += instr.imm << 2;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed jl(state& s, const instruction& instr)
+{
+    if(s.lt)
+        s.registers[reg::PC] += instr.imm << 2; // XXX proposed
+    else
+        s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed jsr(state& s, const instruction& instr)
+{
+    // Rx <= pc, pc <= pc + (sdata24 << 2))
+    s.registers[instr.dst] = s.registers[reg::PC] + 4; // XXX proposed
+    s.registers[reg::PC] += instr.imm << 2;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed jmp(state& s, const instruction& instr)
+{
+    s.registers[reg::PC] = instr.imm << 2;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed jr(state& s, const instruction& instr)
+{
+    s.registers[reg::PC] = s.registers[instr.dst] + (instr.imm << 2);
+    return memory_changed(false, 0);
+}
+
+// The SYS vectors in hypercall::, when state::hypercalls is set; they
+// fall through to the next instruction like any other
+inline memory_changed sys_hypercall(state& s, uint32_t number)
+{
+    uint32_t r0 = s.registers[reg::R0];
+    uint32_t r1 = s.registers[reg::R1];
+    uint32_t r2 = s.registers[reg::R2];
+    int32_t result = r0;
+
+    switch(number) {
+        case hypercall::MEMCPY: s.copy_block(r0, r1, r2); break;
+        case hypercall::MEMSET: s.fill_block(r0, r1, r2); break;
+        case hypercall::MEMCMP: result = s.compare_block(r0, r1, r2); break;
+        case hypercall::CRC32: result = s.crc_block(r0, r1, r2); break;
+    }
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[reg::R0] = result;
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed sys(state& s, const instruction& instr)
+{
+    if(s.hypercalls && instr.data >= hypercall::FIRST)
+        return sys_hypercall(s, instr.data);
+    s.store32(s.registers[reg::SP - 4], s.registers[reg::PC]); // dst is first reg
+    if(s.memory_fault)
+        return memory_changed(false, 0);
+    s.registers[reg::SP] -= 4;
+    s.registers[reg::PC] = instr.data << 2;
+    return memory_changed(true, s.registers[reg::SP]);
+}
+
+inline memory_changed illegal(state& s, const instruction& instr)
+{
+    s.fault(s.registers[reg::PC], vectors::ILLEGAL);
+    return memory_changed(false, 0);
+}
+
+inline memory_changed halt(state& s, const instruction& instr)
+{
+    s.halted = true;
+    return memory_changed(false, 0);
+}
+
+inline memory_changed swapcc(state& s, const instruction& instr)
+{
+    int32_t t = s.registers[instr.dst];
+
+    s.registers[instr.dst] =
+        ((s.carry ? 1 : 0) << 3) |
+        ((s.lt ? 1 : 0) << 2) |
+        ((s.gt ? 1 : 0) << 1) |
+        ((s.eq ? 1 : 0) << 0);
+
+    s.carry = (t & 0x8) ? 1 : 0;
+    s.lt = t & 0x4;
+    s.gt = t & 0x2;
+    s.eq = t & 0x1;
+
+    s.registers[reg::PC] += 4;
+    return memory_changed(false, 0);
+}
+
+// Fused pairs run both handlers back to back so results are exactly
+// those of two separate steps; the first is counted here and the second
+// by the caller as usual.
+template <int kind, instructionfunc first, instructionfunc second>
+memory_changed fused(state& s, const decoded_instruction& d)
+{
+    s.fusion_counts[kind]++;
+    first(s, d.instr);
+    s.instructions++;
+    return second(s, d.second);
+}
+
+// Pairs that touch memory stop after the first on a fault, or if the
+// first store overwrote this pair so the second has to be decoded again.
+template <int kind, instructionfunc first, instructionfunc second>
+memory_changed fused_memory(state& s, const decoded_instruction& d)
+{
+    uint32_t pc = d.pc;
+    memory_changed change = first(s, d.instr);
+    if(s.memory_fault || d.pc != pc)
+        return change;
+    s.fusion_counts[kind]++;
+    s.instructions++;
+    return second(s, d.second);
+}
+
+memory_changed breakpoint_trap(state& s, const decoded_instruction& d)
+{
+    s.trapped = true;
+    s.memory_fault = true;
+    return memory_changed(false, 0);
+}
+
+fusion_info fusions[fusion_kinds] =
+{
+    {opcode::MOVIU, opcode::ADDI, true, fused<0, moviu, addi>, "moviu+addi"},
+    {opcode::MOVIU, opcode::ADDIU, true, fused<1, moviu, addiu>, "moviu+addiu"},
+    {opcode::CMP, opcode::JNE, false, fused<2, cmp, jne>, "cmp+jne"},
+    {opcode::CMP, opcode::JL, false, fused<3, cmp, jl>, "cmp+jl"},
+    {opcode::CMPIU, opcode::JNE, false, fused<4, cmpiu, jne>, "cmpiu+jne"},
+    {opcode::CMPIU, opcode::JL, false, fused<5, cmpiu, jl>, "cmpiu+jl"},
+    {opcode::PUSH, opcode::PUSH, false, fused_memory<6, push, push>, "push+push"},
+    {opcode::POP, opcode::POP, false, fused_memory<7, pop, pop>, "pop+pop"},
+};
+
+fusedfunc state::find_fusion(const instruction& first, uint32_t next, instruction *second)
+{
+    // the first instruction must fall through to the second
+    if(first.dst == reg::PC)
+        return NULL;
+
+    instruction candidate(next);
+    for(int i = 0; i < fusion_kinds; i++) {
+        const fusion_info& f = fusions[i];
+        if(first.opcode == f.first && candidate.opcode == f.second &&
+            (!f.same_dst || first.dst == candidate.dst)) {
+            *second = candidate;
+            return f.func;
+        }
+    }
+    return NULL;
+}
+
+opcode_info opcodes[] =
+{
+    [opcode::MOVIU] = {24, "moviu", moviu},
+    [opcode::ADDI] = {24, "addi", addi},
+    [opcode::SHIFT] = {18, "shift", shift},
+    [opcode::CMPIU] = {24, "cmpiu", cmpiu},
+    [opcode::ADDIU] = {24, "addiu", addiu},
+
+    [opcode::STORE] = {18, "store", store},
+    [opcode::LOAD] = {18, "load", load},
+    [opcode::MOV] = {18, "mov", mov},
+    [opcode::PUSH] = {24, "push", push},
+    [opcode::POP] = {24, "pop", pop},
+
+    [opcode::AND] = {18, "and", op_and},
+    [opcode::OR] = {18, "or", op_or},
+    [opcode::XOR] = {18, "xor", op_xor},
+    [opcode::NOT] = {18, "not", op_not},
+    [opcode::ADD] = {18, "add", add},
+    [opcode::ADC] = {18, "adc", adc},
+    [opcode::SUB] = {18, "sub", sub},
+    [opcode::MULT] = {18, "mult", mult},
+    [opcode::DIV] = {18, "div", div},
+    [opcode::CMP] = {18, "cmp", cmp},
+    [opcode::XCHG] = {18, "xchg", xchg},
+
+    [opcode::JNE] = {27, "jne", jne},
+    [opcode::JL] = {27, "jl", jl},
+    [opcode::JSR] = {27, "jsr", jsr},
+    [opcode::JMP] = {27, "jmp", jmp},
+    [opcode::JR] = {24, "jr", jr},
+    [opcode::SWAPCC] = {24, "swapcc", swapcc},
+
+    [opcode::SYS] = {6, "sys", sys}, // 6 bits is special case
+    [opcode::HALT] = {27, "halt", halt},
+
+    [opcode::UNUSED_19] = {27, "illegal", illegal},
+    [opcode::UNUSED_1d] = {27, "illegal", illegal},
+    [opcode::UNUSED_1e] = {27, "illegal", illegal},
+};
+
+instruction::instruction(uint32_t value)
+{
+    opcode = (value >> 27);
+    dst = (value >> 24) & 0x7;
+    src = (value >> 21) & 0x7;
+    modifier = (value >> 18) & 0x7;
+    data = value & maskbits(opcodes[opcode].datasize);
+    imm = opcodes[opcode].datasize ? sign_extend(data, opcodes[opcode].datasize) : 0;
+}
+
+// Alternative to the table-driven loop in main(): every opcode body is
+// inlined here and dispatch is a computed goto from the decoded-instruction
+// cache (GCC "labels as values"), so there is no indirect call per guest
+// instruction.  Architectural results must match the opcodes[] path.
+// "counting" adds each instruction to state::counts, and is a template
+// argument so the usual loop doesn't test for it.
+template <bool counting>
+void run_threaded_loop(state& s)
+{
+    static const void *labels[] =
+    {
+        &&op_and, &&op_or, &&op_xor, &&op_not,
+        &&op_add, &&op_adc, &&op_sub, &&op_mult,
+        &&op_div, &&op_cmp, &&op_xchg, &&op_mov,
+        &&op_load, &&op_store, &&op_push, &&op_pop,
+        &&op_moviu, &&op_addi, &&op_addiu, &&op_cmpiu,
+        &&op_shift, &&op_jl, &&op_jne, &&op_jr,
+        &&op_jsr, &&op_table, &&op_jmp, &&op_sys,
+        &&op_swapcc, &&op_table, &&op_table, &&op_halt,
+    };
+
+    const decoded_instruction *d;
+    uint32_t pc = 0; // of d, kept in case executing it invalidates d
+    uint first = 0, second = 0;
+    unsigned long long before = 0;
+
+#define DISPATCH() \
+    do { \
+        if(s.instructions >= s.instruction_limit) \
+            return; \
+        if(counting) \
+            pc = s.registers[reg::PC]; \
+        d = &s.decode(s.registers[reg::PC]); \
+        if(s.memory_fault) \
+            return; \
+        if(counting) { \
+            first = d->instr.opcode; \
+            second = d->fused ? d->second.opcode : 0; \
+        } \
+        goto *(s.use_fused(*d) ? &&op_fused : labels[d->instr.opcode]); \
+    } while(0)
+
+#define COUNT() \
+    do { \
+        if(counting) \
+            s.counts->add(pc, first); \
+    } while(0)
+
+#define NEXT() \
+    do { \
+        s.instructions++; \
+        COUNT(); \
+        DISPATCH(); \
+    } while(0)
+
+#define NEXT_CHECKED() \
+    do { \
+        if(s.memory_fault) \
+            return; \
+        NEXT(); \
+    } while(0)
+
+    DISPATCH();
+
+op_and:     op_and(s, d->instr); NEXT();
+op_or:      op_or(s, d->instr); NEXT();
+op_xor:     op_xor(s, d->instr); NEXT();
+op_not:     op_not(s, d->instr); NEXT();
+op_add:     add(s, d->instr); NEXT();
+op_adc:     adc(s, d->instr); NEXT();
+op_sub:     sub(s, d->instr); NEXT();
+op_mult:    mult(s, d->instr); NEXT();
+op_div:     div(s, d->instr); NEXT();
+op_cmp:     cmp(s, d->instr); NEXT();
+op_xchg:    xchg(s, d->instr); NEXT();
+op_mov:     mov(s, d->instr); NEXT();
+op_load:    load(s, d->instr); NEXT_CHECKED();
+op_store:   store(s, d->instr); NEXT_CHECKED();
+op_push:    push(s, d->instr); NEXT_CHECKED();
+op_pop:     pop(s, d->instr); NEXT_CHECKED();
+op_moviu:   moviu(s, d->instr); NEXT();
+op_addi:    addi(s, d->instr); NEXT();
+op_addiu:   addiu(s, d->instr); NEXT();
+op_cmpiu:   cmpiu(s, d->instr); NEXT();
+op_shift:   shift(s, d->instr); NEXT();
+op_jl:      jl(s, d->instr); NEXT();
+op_jne:     jne(s, d->instr); NEXT();
+op_jr:      jr(s, d->instr); NEXT();
+op_jsr:     jsr(s, d->instr); NEXT();
+op_jmp:     jmp(s, d->instr); NEXT();
+op_sys:     sys(s, d->instr); NEXT_CHECKED();
+op_swapcc:  swapcc(s, d->instr); NEXT();
+op_halt:    halt(s, d->instr); s.instructions++; COUNT(); return;
+
+op_fused:   // the first of a pair can complete even if the second faults
+    if(counting)
+        before = s.instructions;
+    d->fused(s, *d);
+    if(counting)
+        s.counts->add(pc, first, second, s.instructions - before + !s.memory_fault);
+    if(s.memory_fault)
+        return;
+    s.instructions++;
+    DISPATCH();
+
+op_table:   // anything without its own label goes through opcodes[] as main() would
+    d->func(s, d->instr);
+    if(s.memory_fault)
+        return;
+    s.instructions++;
+    COUNT();
+    if(s.halted)
+        return;
+    DISPATCH();
+
+#undef NEXT_CHECKED
+#undef NEXT
+#undef COUNT
+#undef DISPATCH
+}
+
+void run_threaded(state& s)
+{
+    if(s.counts)
+        run_threaded_loop<true>(s);
+    else
+        run_threaded_loop<false>(s);
+}
+
+#if defined(__x86_64__)
+extern "C" int jit_helper(state *s, const instruction *instr)
+{
+    uint32_t pc = s->registers[reg::PC];
+    opcodes[instr->opcode].func(*s, *instr);
+    if(s->memory_fault)
+        return 1;
+    s->instructions++;
+    if(s->counts)
+        s->counts->add(pc, instr->opcode);
+    return s->halted || s->code_dirty || (uint32_t)s->registers[reg::PC] != pc + 4;
+}
+#endif
+
+const char snapshot_magic[8] = {'S', 'C', 'P', 'U', 'S', 'N', 'P', '1'};
+
+bool write_snapshot(const snapshot& snap, const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if(fp == NULL)
+        return false;
+
+    static const uint8_t zeros[page_size] = {0};
+    snapshot_header h;
+    memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+    memcpy(h.registers, snap.registers, sizeof(h.registers));
+    h.flags = (snap.lt << 0) | (snap.eq << 1) | (snap.gt << 2) | (snap.halted << 3) |
+        ((snap.carry ? 1 : 0) << 4) | (snap.memory_fault << 5);
+    h.fault_address = snap.fault_address;
+    h.instructions = snap.instructions;
+    h.page_shift = page_shift;
+    h.page_count = 0;
+    for(size_t i = 0; i < snap.pages.size(); i++)
+        if(memcmp(snap.pages[i].data, zeros, page_size) != 0)
+            h.page_count++;
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for(size_t i = 0; ok && i < snap.pages.size(); i++) {
+        if(memcmp(snap.pages[i].data, zeros, page_size) == 0)
+            continue;
+        ok = fwrite(&snap.pages[i].number, sizeof(uint32_t), 1, fp) == 1 &&
+            fwrite(snap.pages[i].data, page_size, 1, fp) == 1;
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+const char *read_snapshot(state& s, const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if(fp == NULL)
+        return strerror(errno);
+
+    snapshot_header h;
+    const char *error = NULL;
+    if(fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0 || h.page_shift != page_shift)
+        error = "not a snapshot file";
+
+    std::vector<uint8_t> page(page_size);
+    for(uint32_t i = 0; error == NULL && i < h.page_count; i++) {
+        uint32_t number;
+        if(fread(&number, sizeof(number), 1, fp) != 1 || fread(&page[0], page_size, 1, fp) != 1)
+            error = "snapshot file is truncated";
+        else if(number >= page_count || s.write_block(number << page_shift, &page[0], page_size) != page_size)
+            error = "snapshot has a page outside RAM";
+    }
+    fclose(fp);
+    if(error != NULL)
+        return error;
+
+    memcpy(s.registers, h.registers, sizeof(s.registers));
+    s.lt = h.flags & (1 << 0);
+    s.eq = h.flags & (1 << 1);
+    s.gt = h.flags & (1 << 2);
+    s.halted = h.flags & (1 << 3);
+    s.carry = (h.flags >> 4) & 1;
+    s.memory_fault = h.flags & (1 << 5);
+    s.fault_address = h.fault_address;
+    s.instructions = h.instructions;
+    return NULL;
+}
+
+uint8_t *map_image(const char *filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+
+    // mmap() refuses zero length; an empty image is just zero-filled RAM
+    void *p = mmap(NULL, std::max(*size, (size_t)1), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return (p == MAP_FAILED) ? NULL : (uint8_t *)p;
+}
+
+std::vector<uint8_t> read_image(FILE *fp)
+{
+    const size_t block = 1024 * 1024;
+    std::vector<uint8_t> image;
+    size_t n;
+    do {
+        size_t old = image.size();
+        image.resize(old + block);
+        n = fread(&image[old], 1, block, fp);
+        image.resize(old + n);
+    } while(n > 0);
+    return image;
+}
+
+// By vectors:: address / 4
+const char *simulator::fault_names[] = {"fault", "illegal instruction", "unaligned access", "memory fault"};
@@ -0,0 +1,2618 @@
+// The simulator core: guest state and memory, the instruction handlers,
+// the interpreters and JIT, devices, snapshots, tracing, profiling and
+// timing, and struct simulator tying them together.  Shared by sim and
+// libsimple_cpu; the definitions that can't live in a header are in
+// simulator.cpp.  Include this instead of simple_cpu_2014.hpp.
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simple_cpu_2014.hpp"
+#include "trace.hpp"
+
+const int registercount = 8;
+const int page_shift = 12;
+const uint32_t page_size = 1 << page_shift;
+const uint32_t page_mask = page_size - 1;
+const uint32_t page_count = 1 << (32 - page_shift);
+const int l1_shift = 22;
+const uint32_t l1_size = 1 << l1_shift;
+const uint32_t l1_entries = 1 << (32 - l1_shift);
+const uint32_t l2_entries = 1 << (l1_shift - page_shift);
+const uint32_t l2_mask = l2_entries - 1;
+const int decode_cache_lines = 16 * 1024; // direct-mapped, one instruction per line
+const uint32_t invalid_pc = 0xffffffff; // never matches a cached (aligned) PC
+
+using namespace simple_cpu_2014;
+
+inline int32_t sign_extend(uint32_t v, int bits)
+{
+    bool negative = v & (1 << (bits - 1));
+    return negative ? (v | (0xffffffff << bits)) : v;
+}
+
+struct state;
+
+// Memory-mapped device; addr is the full guest address and size is 1, 2 or 4
+struct device
+{
+    virtual uint32_t read(uint32_t addr, uint32_t size) = 0;
+    virtual void write(uint32_t addr, uint32_t value, uint32_t size) = 0;
+    virtual ~device() {}
+};
+
+// Something state::schedule() calls back once the guest has executed a
+// given number of instructions; kind tells apart a source's own events
+struct event_source
+{
+    virtual void event(state& s, int kind) = 0;
+    virtual ~event_source() {}
+};
+
+struct event
+{
+    unsigned long long when; // state::instructions
+    event_source *source;
+    int kind;
+
+    // std heaps keep the largest on top, so this puts the soonest there
+    bool operator<(const event& other) const { return when > other.when; }
+};
+
+struct page_table
+{
+    uint8_t *read[l2_entries];
+    uint8_t *write[l2_entries];
+    device *devices[l2_entries];
+    bool owned[l2_entries]; // write[] was allocated by allocate_page()
+};
+
+extern uint8_t zero_page[page_size];
+
+// Shared by every state and only written during static initialization
+extern page_table hole_table; // every page unmapped
+extern page_table zero_table; // every page RAM that hasn't been written yet
+
+// RAM pages allocated by a state.  A snapshot holds references to the
+// state's pages, which stay read-only on both sides until a store gives
+// the state a private copy; see state::allocate_page().  Not shared
+// between threads.
+struct page_block
+{
+    uint8_t data[page_size]; // first, so a page's data is its block
+    unsigned refs;
+};
+
+// New page with a copy of contents, or zero-filled for the zero page
+inline uint8_t *new_page(const uint8_t *contents)
+{
+    page_block *b = (contents == zero_page) ? new page_block() : new page_block;
+    if(contents != zero_page)
+        memcpy(b->data, contents, page_size);
+    b->refs = 1;
+    return b->data;
+}
+
+inline void hold_page(uint8_t *page)
+{
+    ((page_block *)page)->refs++;
+}
+
+inline void drop_page(uint8_t *page)
+{
+    page_block *b = (page_block *)page;
+    if(--b->refs == 0)
+        delete b;
+}
+
+struct instruction
+{
+    uint opcode;
+    uint dst;
+    uint src;
+    uint modifier;
+    uint data;
+    int32_t imm; // data sign-extended from the opcode's datasize
+    instruction() {}
+    instruction(uint32_t value);
+};
+
+typedef std::pair<bool, uint32_t> memory_changed;
+
+typedef memory_changed (*instructionfunc)(state&, const instruction&);
+
+struct opcode_info {
+    int datasize;
+    const char *name;
+    instructionfunc func;
+};
+
+extern opcode_info opcodes[];
+
+struct decoded_instruction;
+
+typedef memory_changed (*fusedfunc)(state&, const decoded_instruction&);
+
+// Common instruction pairs executed as one operation; see fusions[]
+struct fusion_info {
+    uint first;
+    uint second;
+    bool same_dst; // both instructions must name the same dst register
+    fusedfunc func;
+    const char *name;
+};
+
+const int fusion_kinds = 8;
+
+extern fusion_info fusions[fusion_kinds];
+
+// An instruction word decoded once and kept by PC so the main loop can
+// skip fetch and decode; stores into a cached word invalidate the line.
+// If the word and the one after it form a fused pair, "fused" executes
+// both; a branch to the second word decodes it on its own line.
+struct decoded_instruction
+{
+    uint32_t pc;
+    instructionfunc func;
+    instruction instr;
+    fusedfunc fused;
+    instruction second;
+};
+
+memory_changed breakpoint_trap(state& s, const decoded_instruction& d);
+
+// Registers, flags and RAM contents of a state at one point; see
+// state::take_snapshot().  The address-space layout, devices and decode
+// caches aren't included, so a snapshot is restored into the state that
+// took it or one mapped the same way.
+struct snapshot
+{
+    struct page
+    {
+        uint32_t number; // address >> page_shift
+        uint8_t *data;
+        bool owned; // a page_block reference, otherwise host memory
+    };
+
+    int32_t registers[registercount];
+    bool lt, eq, gt, halted;
+    int carry;
+    bool memory_fault;
+    uint32_t fault_address;
+    unsigned long long instructions;
+    std::vector<page> pages; // in page order; the rest of RAM is zero
+
+    const state *owner;
+    unsigned long long serial;
+
+    snapshot() : owner(NULL), serial(0) {}
+    ~snapshot() { clear(); }
+
+    void clear()
+    {
+        for(size_t i = 0; i < pages.size(); i++)
+            if(pages[i].owned)
+                drop_page(pages[i].data);
+        pages.clear();
+        owner = NULL;
+    }
+
+    // Contents of a page, or NULL if it's zero
+    const page *find(uint32_t number) const
+    {
+        size_t lo = 0, hi = pages.size();
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(pages[mid].number < number)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return (lo < pages.size() && pages[lo].number == number) ? &pages[lo] : NULL;
+    }
+
+private:
+    snapshot(const snapshot&);
+    snapshot& operator=(const snapshot&);
+};
+
+// Executions per PC, kept in per-page arrays laid out like guest memory
+// and allocated when a page first executes, and per opcode.  While
+// state::counts points at one every engine adds to it, so a --profile
+// report doesn't need the stepping loop.
+struct execution_counts
+{
+    static const uint32_t words_per_page = page_size / 4;
+
+    uint64_t **l1[l1_entries]; // counts per word of each executed page
+    unsigned long long opcode_counts[32];
+    uint32_t last_page; // page of the last count(), usually the next one's too
+    uint64_t *last_counts;
+
+    execution_counts() : last_page(invalid_pc), last_counts(NULL)
+    {
+        memset(l1, 0, sizeof(l1));
+        memset(opcode_counts, 0, sizeof(opcode_counts));
+    }
+
+    ~execution_counts()
+    {
+        for(uint32_t i = 0; i < l1_entries; i++) {
+            if(l1[i] == NULL)
+                continue;
+            for(uint32_t j = 0; j < l2_entries; j++)
+                delete[] l1[i][j];
+            delete[] l1[i];
+        }
+    }
+
+    // The slot stays put, so the JIT can add to it directly
+    uint64_t& count(uint32_t pc)
+    {
+        if((pc >> page_shift) == last_page)
+            return last_counts[(pc & page_mask) / 4];
+
+        uint64_t **&table = l1[pc >> l1_shift];
+        if(table == NULL)
+            table = new uint64_t *[l2_entries]();
+        uint64_t *&page = table[(pc >> page_shift) & l2_mask];
+        if(page == NULL)
+            page = new uint64_t[words_per_page]();
+        last_page = pc >> page_shift;
+        last_counts = page;
+        return page[(pc & page_mask) / 4];
+    }
+
+    void add(uint32_t pc, uint opcode)
+    {
+        count(pc)++;
+        opcode_counts[opcode]++;
+    }
+
+    // A decoded entry at pc that completed "executed" instructions: none
+    // if it faulted, and two for the whole of a fused pair
+    void add(uint32_t pc, uint first, uint second, unsigned long long executed)
+    {
+        if(executed > 0)
+            add(pc, first);
+        if(executed > 1)
+            add(pc + 4, second);
+    }
+
+private:
+    execution_counts(const execution_counts&);
+    execution_counts& operator=(const execution_counts&);
+};
+
+struct state
+{
+    int32_t registers[registercount];
+    bool lt, eq, gt, halted;
+    bool separate_instructions;
+    int carry;
+
+    bool memory_fault;
+    uint32_t fault_address;
+    uint32_t fault_vector; // vectors:: handler for the fault, e.g. BAD_ACCESS
+
+    bool hypercalls; // SYS hypercall:: vectors run on the host
+
+    // Faults halt the guest unless exceptions is set, in which case they
+    // stop the engines with memory_fault and take_exception() runs the
+    // handler.  A faulting instruction changes nothing, so it's precise.
+    bool exceptions;
+
+    // Debugger breakpoints.  A hit sets trapped, and memory_fault so that
+    // every engine stops as it does on a fault, before counting it.
+    std::unordered_set<uint32_t> breakpoints;
+    bool trapped;
+
+    uint32_t *program; // instruction words if separate_instructions
+    uint32_t programsize;
+
+    unsigned long long instructions;
+    unsigned long long instruction_limit; // every engine stops once instructions reaches this
+
+    // Pending events, a heap with the soonest first.  Engines never look
+    // at it: instruction_limit is kept at the sooner of run_limit and the
+    // first event, so they stop there and run_events() takes over.
+    std::vector<event> events;
+    unsigned long long run_limit; // see set_limit()
+
+    bool fuse; // recognize fusions[] pairs when decoding
+    unsigned long long fusion_counts[fusion_kinds];
+
+    execution_counts *counts; // if set, every engine counts into it
+
+    decoded_instruction decoded[decode_cache_lines];
+    decoded_instruction uncached;
+
+    // pages holding JIT-translated code; a store to one sets code_dirty
+    uint8_t code_pages[page_count];
+    bool code_dirty;
+
+    void invalidate_decoded(uint32_t addr, uint32_t size)
+    {
+        if(size == 0)
+            return;
+        if(addr + size - 1 < addr) {
+            // past the top of the address space the range wraps to 0
+            invalidate_decoded(addr, 0u - addr);
+            invalidate_decoded(0, size - (0u - addr));
+            return;
+        }
+        uint32_t first = addr & ~3;
+        uint32_t last = (addr + size - 1) & ~3;
+        if(size > decode_cache_lines * 4) {
+            invalidate_all_decoded();
+        } else {
+            for(uint32_t a = first; ; a += 4) {
+                decoded_instruction& d = decoded[(a >> 2) % decode_cache_lines];
+                if(d.pc == a)
+                    d.pc = invalid_pc;
+                if(a == last)
+                    break;
+            }
+            // a fused pair starting on the previous word includes this one
+            decoded_instruction& prev = decoded[((first - 4) >> 2) % decode_cache_lines];
+            if(prev.pc == first - 4 && prev.fused != NULL)
+                prev.pc = invalid_pc;
+        }
+        for(uint32_t page = addr >> page_shift; ; page++) {
+            if(code_pages[page])
+                code_dirty = true;
+            if(page == (addr + size - 1) >> page_shift)
+                break;
+        }
+    }
+
+    void invalidate_all_decoded()
+    {
+        for(int i = 0; i < decode_cache_lines; i++)
+            decoded[i].pc = invalid_pc;
+    }
+
+    // Stop running once instructions reaches limit
+    void set_limit(unsigned long long limit)
+    {
+        run_limit = limit;
+        update_limit();
+    }
+
+    void update_limit()
+    {
+        instruction_limit = events.empty() ? run_limit : std::min(run_limit, events.front().when);
+    }
+
+    // Calls source->event(kind) once instructions reaches when, at the end
+    // of a block or sooner; a when already past means at the next one
+    void schedule(unsigned long long when, event_source *source, int kind)
+    {
+        event e = {when, source, kind};
+        events.push_back(e);
+        std::push_heap(events.begin(), events.end());
+        update_limit();
+    }
+
+    void unschedule(event_source *source, int kind)
+    {
+        size_t kept = 0;
+        for(size_t i = 0; i < events.size(); i++)
+            if(events[i].source != source || events[i].kind != kind)
+                events[kept++] = events[i];
+        if(kept == events.size())
+            return;
+        events.resize(kept);
+        std::make_heap(events.begin(), events.end());
+        update_limit();
+    }
+
+    // Calls back every event that's due; true if the guest should carry on
+    // running, that is some were due and run_limit isn't reached
+    bool run_events()
+    {
+        if(events.empty() || events.front().when > instructions)
+            return false;
+        while(!events.empty() && events.front().when <= instructions) {
+            event e = events.front();
+            std::pop_heap(events.begin(), events.end());
+            events.pop_back();
+            e.source->event(*this, e.kind);
+        }
+        update_limit();
+        return instructions < run_limit;
+    }
+
+    uint32_t fetch_instruction(uint32_t pc);
+    bool peek_instruction(uint32_t pc, uint32_t *word);
+    fusedfunc find_fusion(const instruction& first, uint32_t next, instruction *second);
+
+    const decoded_instruction& decode(uint32_t pc)
+    {
+        // unaligned PCs are decoded every time into "uncached"
+        bool cacheable = (pc & 3) == 0;
+        decoded_instruction& d = cacheable ? decoded[(pc >> 2) % decode_cache_lines] : uncached;
+        if(cacheable && d.pc == pc)
+            return d;
+
+        uint32_t word = fetch_instruction(pc);
+        d.instr = instruction(word);
+        d.func = opcodes[d.instr.opcode].func;
+        d.pc = (cacheable && !memory_fault) ? pc : invalid_pc;
+        d.fused = NULL;
+
+        uint32_t next;
+        if(fuse && d.pc == pc && peek_instruction(pc + 4, &next))
+            d.fused = find_fusion(d.instr, next, &d.second);
+        if(!breakpoints.empty())
+            mark_breakpoint(d, pc);
+        return d;
+    }
+
+    // Whether d runs through its fused handler: a breakpoint always does,
+    // a pair only if both fit before instruction_limit
+    bool use_fused(const decoded_instruction& d) const
+    {
+        return d.fused != NULL && (d.fused == breakpoint_trap || instruction_limit - instructions >= 2);
+    }
+
+    // A breakpoint takes the place of the fused handler, so the
+    // interpreters stop there without comparing PCs; pairs aren't fused
+    // across one
+    void mark_breakpoint(decoded_instruction& d, uint32_t pc)
+    {
+        if(breakpoints.count(pc))
+            d.fused = breakpoint_trap;
+        else if(d.fused != NULL && breakpoints.count(pc + 4))
+            d.fused = NULL;
+    }
+
+    void set_breakpoint(uint32_t pc)
+    {
+        breakpoints.insert(pc);
+        invalidate_decoded(pc, 4);
+        code_dirty = true; // translated blocks may run through it
+    }
+
+    void clear_breakpoint(uint32_t pc)
+    {
+        breakpoints.erase(pc);
+        invalidate_decoded(pc, 4);
+        code_dirty = true;
+    }
+
+    // Executes the instruction at PC, even if there's a breakpoint on it
+    void single_step()
+    {
+        uint32_t word = fetch_instruction(registers[reg::PC]);
+        if(memory_fault)
+            return;
+        uint32_t pc = registers[reg::PC];
+        instruction instr(word);
+        opcodes[instr.opcode].func(*this, instr);
+        if(memory_fault)
+            return;
+        instructions++;
+        if(counts)
+            counts->add(pc, instr.opcode);
+    }
+
+    // Guest address space, two-level: l1 has one page_table per 4 MiB.
+    // read[] of RAM that has never been written points at the shared zero
+    // page and its write[] is NULL; the first store allocates the page.
+    // Device pages have NULL read[] and write[] and a handler in devices[].
+    // Anything else faults.  l1 entries that are all hole or all untouched
+    // RAM point at the shared hole_table or zero_table until they diverge.
+    page_table *l1[l1_entries];
+    size_t allocated_pages;
+
+    // RAM pages given their own copy since the snapshot numbered
+    // base_serial was taken or restored, so restoring it again only
+    // touches those
+    std::vector<uint32_t> dirty_pages;
+    unsigned long long base_serial;
+    unsigned long long snapshots_taken;
+
+    uint8_t *read_page(uint32_t addr) { return l1[addr >> l1_shift]->read[(addr >> page_shift) & l2_mask]; }
+    uint8_t *write_page(uint32_t addr) { return l1[addr >> l1_shift]->write[(addr >> page_shift) & l2_mask]; }
+
+    page_table& private_table(uint32_t addr)
+    {
+        page_table *&t = l1[addr >> l1_shift];
+        if(t == &hole_table || t == &zero_table)
+            t = new page_table(*t);
+        return *t;
+    }
+
+    // size is 64 bits so the whole 4 GiB can be mapped
+    void map_ram(uint32_t base, uint64_t size)
+    {
+        for(uint64_t offset = 0; offset < size; offset += page_size) {
+            uint32_t addr = base + offset;
+            if((addr & (l1_size - 1)) == 0 && size - offset >= l1_size && l1[addr >> l1_shift] == &hole_table) {
+                l1[addr >> l1_shift] = &zero_table;
+                offset += l1_size - page_size;
+                continue;
+            }
+            page_table& t = private_table(addr);
+            uint32_t i = (addr >> page_shift) & l2_mask;
+            if(t.write[i] == NULL)
+                t.read[i] = zero_page;
+            t.devices[i] = NULL;
+        }
+    }
+
+    void map_device(uint32_t base, uint32_t size, device *dev)
+    {
+        for(uint32_t offset = 0; offset < size; offset += page_size) {
+            page_table& t = private_table(base + offset);
+            uint32_t i = ((base + offset) >> page_shift) & l2_mask;
+            release_page(t, i);
+            t.read[i] = NULL;
+            t.write[i] = NULL;
+            t.devices[i] = dev;
+        }
+    }
+
+    // Maps size bytes of host memory, e.g. a private file mapping, as RAM
+    // at base; the caller keeps ownership and must outlive the mapping
+    void map_host(uint32_t base, uint8_t *host, uint64_t size)
+    {
+        for(uint64_t offset = 0; offset < size; offset += page_size) {
+            page_table& t = private_table(base + offset);
+            uint32_t i = ((base + offset) >> page_shift) & l2_mask;
+            release_page(t, i);
+            t.read[i] = host + offset;
+            t.write[i] = host + offset;
+            t.devices[i] = NULL;
+        }
+    }
+
+    // Gives the RAM page holding addr its own memory on first store, or on
+    // the first store since a snapshot made it read-only
+    uint8_t *allocate_page(uint32_t addr)
+    {
+        page_table& t = private_table(addr);
+        uint32_t i = (addr >> page_shift) & l2_mask;
+        if(t.write[i] == NULL) {
+            if(t.owned[i] && ((page_block *)t.read[i])->refs == 1) {
+                t.write[i] = t.read[i]; // no snapshot holds it any more
+            } else {
+                uint8_t *page = new_page(t.read[i]);
+                if(t.owned[i])
+                    drop_page(t.read[i]);
+                else
+                    allocated_pages++;
+                t.read[i] = page;
+                t.write[i] = page;
+                t.owned[i] = true;
+            }
+            dirty_pages.push_back(addr >> page_shift);
+        }
+        return t.write[i];
+    }
+
+    void release_page(page_table& t, uint32_t i)
+    {
+        if(t.owned[i]) {
+            drop_page(t.read[i]);
+            t.owned[i] = false;
+            allocated_pages--;
+        }
+        t.write[i] = NULL;
+    }
+
+    // Records registers, flags and every RAM page that isn't zero.  Pages
+    // aren't copied: both sides keep a reference and the state's copy
+    // becomes read-only, so the next store to it copies just that page.
+    // If previous is the last snapshot taken or restored here, only the
+    // pages stored to since are looked at and the rest are shared with it.
+    void take_snapshot(snapshot& snap, const snapshot *previous = NULL)
+    {
+        std::vector<snapshot::page> pages;
+        if(previous != NULL && previous->owner == this && previous->serial == base_serial) {
+            std::sort(dirty_pages.begin(), dirty_pages.end());
+            dirty_pages.erase(std::unique(dirty_pages.begin(), dirty_pages.end()), dirty_pages.end());
+            size_t d = 0;
+            for(size_t i = 0; i <= previous->pages.size(); i++) {
+                uint32_t number = (i < previous->pages.size()) ? previous->pages[i].number : 0xffffffff;
+                for(; d < dirty_pages.size() && dirty_pages[d] <= number; d++)
+                    share_page(pages, dirty_pages[d]);
+                if(i == previous->pages.size() || (d > 0 && dirty_pages[d - 1] == number))
+                    continue;
+                pages.push_back(previous->pages[i]); // still read-only here
+                if(pages.back().owned)
+                    hold_page(pages.back().data);
+            }
+        } else {
+            for(uint32_t i = 0; i < l1_entries; i++) {
+                page_table& t = *l1[i];
+                if(&t == &hole_table || &t == &zero_table)
+                    continue;
+                for(uint32_t j = 0; j < l2_entries; j++)
+                    share_page(pages, (i << (l1_shift - page_shift)) | j);
+            }
+        }
+
+        snap.clear(); // after sharing, in case snap is previous
+        snap.pages.swap(pages);
+        memcpy(snap.registers, registers, sizeof(registers));
+        snap.lt = lt;
+        snap.eq = eq;
+        snap.gt = gt;
+        snap.halted = halted;
+        snap.carry = carry;
+        snap.memory_fault = memory_fault;
+        snap.fault_address = fault_address;
+        snap.instructions = instructions;
+
+        snap.owner = this;
+        snap.serial = ++snapshots_taken;
+        base_serial = snap.serial;
+        dirty_pages.clear();
+    }
+
+    // Adds a reference to page number to pages unless it's zero or not
+    // RAM, and makes the state's copy read-only
+    void share_page(std::vector<snapshot::page>& pages, uint32_t number)
+    {
+        page_table& t = *l1[number >> (l1_shift - page_shift)];
+        uint32_t i = number & l2_mask;
+        if(t.read[i] == NULL || t.read[i] == zero_page)
+            return;
+        snapshot::page page = { number, t.read[i], t.owned[i] };
+        if(page.owned)
+            hold_page(page.data);
+        t.write[i] = NULL;
+        pages.push_back(page);
+    }
+
+    // Returns to a snapshot.  If it's the last one taken or restored here
+    // only the pages stored to since are put back; otherwise every RAM
+    // page is.
+    void restore_snapshot(const snapshot& snap)
+    {
+        if(snap.owner == this && snap.serial == base_serial) {
+            for(size_t i = 0; i < dirty_pages.size(); i++)
+                restore_page(snap, dirty_pages[i]);
+        } else {
+            for(uint32_t i = 0; i < l1_entries; i++) {
+                page_table& t = *l1[i];
+                if(&t == &hole_table || &t == &zero_table)
+                    continue;
+                for(uint32_t j = 0; j < l2_entries; j++)
+                    if(t.read[j] != NULL && t.read[j] != zero_page)
+                        restore_page(snap, (i << (l1_shift - page_shift)) | j);
+            }
+            for(size_t i = 0; i < snap.pages.size(); i++)
+                restore_page(snap, snap.pages[i].number);
+            base_serial = (snap.owner == this) ? snap.serial : 0;
+        }
+        dirty_pages.clear();
+
+        memcpy(registers, snap.registers, sizeof(registers));
+        lt = snap.lt;
+        eq = snap.eq;
+        gt = snap.gt;
+        halted = snap.halted;
+        carry = snap.carry;
+        memory_fault = snap.memory_fault;
+        fault_address = snap.fault_address;
+        instructions = snap.instructions;
+
+        invalidate_all_decoded();
+        code_dirty = true; // translated code may come from replaced pages
+    }
+
+    void restore_page(const snapshot& snap, uint32_t number)
+    {
+        page_table& t = private_table(number << page_shift);
+        uint32_t i = number & l2_mask;
+        const snapshot::page *page = snap.find(number);
+        if(page != NULL && page->data == t.read[i]) {
+            t.write[i] = NULL; // unchanged, but still shared with snap
+            return;
+        }
+        release_page(t, i);
+        if(page == NULL) {
+            t.read[i] = zero_page;
+        } else {
+            t.read[i] = page->data;
+            t.owned[i] = page->owned;
+            if(page->owned) {
+                hold_page(page->data);
+                allocated_pages++;
+            }
+        }
+    }
+
+    // Copies len bytes into guest RAM a page at a time, allocating pages as
+    // a store would; returns bytes copied, stopping at the first non-RAM page
+    // or the top of the address space
+    uint32_t write_block(uint32_t addr, const uint8_t *src, uint32_t len)
+    {
+        len = std::min((uint64_t)len, ((uint64_t)1 << 32) - addr); // stop at the top
+        uint32_t done = 0;
+        while(done < len) {
+            if(read_page(addr + done) == NULL)
+                break;
+            uint8_t *page = allocate_page(addr + done);
+            uint32_t offset = (addr + done) & page_mask;
+            uint32_t n = std::min(len - done, page_size - offset);
+            memcpy(page + offset, src + done, n);
+            done += n;
+        }
+        if(done > 0)
+            invalidate_decoded(addr, done);
+        return done;
+    }
+
+    // Copies up to len bytes of guest RAM starting at addr a page at a time,
+    // stopping at the first address that isn't RAM or the top of the address
+    // space; returns bytes copied
+    uint32_t read_block(uint32_t addr, uint8_t *dst, uint32_t len)
+    {
+        len = std::min((uint64_t)len, ((uint64_t)1 << 32) - addr); // stop at the top
+        uint32_t done = 0;
+        while(done < len) {
+            uint8_t *page = read_page(addr + done);
+            if(page == NULL)
+                break;
+            uint32_t offset = (addr + done) & page_mask;
+            uint32_t n = std::min(len - done, page_size - offset);
+            memcpy(dst + done, page + offset, n);
+            done += n;
+        }
+        return done;
+    }
+
+    // Host-speed block operations on guest RAM for hypercalls, a page at a
+    // time.  Each checks its whole range first, so a fault changes nothing.
+    bool check_ram(uint32_t addr, uint32_t len)
+    {
+        if(len == 0)
+            return true;
+        uint32_t last = addr + len - 1;
+        if(last < addr) {
+            fault(addr);
+            return false;
+        }
+        for(uint32_t a = addr; ; a = (a & ~page_mask) + page_size) {
+            if(read_page(a) == NULL) {
+                fault(a);
+                return false;
+            }
+            if((a >> page_shift) == (last >> page_shift))
+                return true;
+        }
+    }
+
+    // Like memmove()
+    void copy_block(uint32_t dst, uint32_t src, uint32_t len)
+    {
+        if(!check_ram(src, len) || !check_ram(dst, len) || len == 0)
+            return;
+        if(dst - src < len) {
+            // dst overlaps the end of src, so copy from the end back
+            for(uint32_t left = len; left > 0; ) {
+                uint32_t to = dst + left - 1, from = src + left - 1;
+                uint32_t n = std::min(left, std::min((to & page_mask) + 1, (from & page_mask) + 1));
+                uint8_t *page = allocate_page(to); // before reading, in case it's the same page
+                memmove(page + (to & page_mask) - (n - 1), read_page(from) + (from & page_mask) - (n - 1), n);
+                left -= n;
+            }
+        } else {
+            for(uint32_t done = 0; done < len; ) {
+                uint32_t to = dst + done, from = src + done;
+                uint32_t n = std::min(len - done, std::min(page_size - (to & page_mask), page_size - (from & page_mask)));
+                uint8_t *page = allocate_page(to);
+                memmove(page + (to & page_mask), read_page(from) + (from & page_mask), n);
+                done += n;
+            }
+        }
+        invalidate_decoded(dst, len);
+    }
+
+    void fill_block(uint32_t dst, uint8_t value, uint32_t len)
+    {
+        if(!check_ram(dst, len) || len == 0)
+            return;
+        for(uint32_t done = 0; done < len; ) {
+            uint32_t to = dst + done;
+            uint32_t n = std::min(len - done, page_size - (to & page_mask));
+            memset(allocate_page(to) + (to & page_mask), value, n);
+            done += n;
+        }
+        invalidate_decoded(dst, len);
+    }
+
+    // -1, 0 or 1 as the first differing byte of a is less, or greater
+    int compare_block(uint32_t a, uint32_t b, uint32_t len)
+    {
+        if(!check_ram(a, len) || !check_ram(b, len))
+            return 0;
+        for(uint32_t done = 0; done < len; ) {
+            uint32_t x = a + done, y = b + done;
+            uint32_t n = std::min(len - done, std::min(page_size - (x & page_mask), page_size - (y & page_mask)));
+            int diff = memcmp(read_page(x) + (x & page_mask), read_page(y) + (y & page_mask), n);
+            if(diff != 0)
+                return (diff < 0) ? -1 : 1;
+            done += n;
+        }
+        return 0;
+    }
+
+    // zlib's CRC-32, carrying on from crc
+    uint32_t crc_block(uint32_t addr, uint32_t crc, uint32_t len)
+    {
+        if(!check_ram(addr, len))
+            return 0;
+        for(uint32_t done = 0; done < len; ) {
+            uint32_t a = addr + done;
+            uint32_t n = std::min(len - done, page_size - (a & page_mask));
+            crc = crc32(crc, read_page(a) + (a & page_mask), n);
+            done += n;
+        }
+        return crc;
+    }
+
+    bool is_ram(uint32_t addr, uint32_t size)
+    {
+        uint32_t last = addr + size - 1;
+        return last >= addr && read_page(addr) != NULL && read_page(last) != NULL;
+    }
+
+    void fault(uint32_t addr, uint32_t vector = vectors::BAD_ACCESS)
+    {
+        memory_fault = true; fault_address = addr;
+        fault_vector = vector;
+        halted = !exceptions;
+    }
+
+    // Enters the handler for the fault that stopped the guest as SYS would,
+    // pushing the faulting instruction's address; false if it's not an
+    // exception (a breakpoint, or exceptions are off) or the push faulted
+    bool take_exception()
+    {
+        if(!memory_fault || trapped || !exceptions)
+            return false;
+        memory_fault = false;
+        uint32_t vector = fault_vector;
+        uint32_t sp = registers[reg::SP] - 4;
+        store32(sp, registers[reg::PC]);
+        if(memory_fault) {
+            halted = true;
+            return false;
+        }
+        registers[reg::SP] = sp;
+        registers[reg::PC] = vector;
+        return true;
+    }
+
+    // Accesses that aren't aligned RAM: devices, unaligned RAM accesses
+    // (which may straddle two pages), first stores to a page, and faults.
+    // Aligned accesses never straddle, so the fast paths test only that.
+    uint32_t fetch_slow(uint32_t addr, uint32_t size)
+    {
+        if(exceptions && (addr & (size - 1))) {
+            fault(addr, vectors::UNALIGNED);
+            return 0;
+        }
+
+        device *dev = l1[addr >> l1_shift]->devices[(addr >> page_shift) & l2_mask];
+        if(dev != NULL)
+            return dev->read(addr, size);
+
+        if(!is_ram(addr, size)) {
+            fault(addr);
+            return 0;
+        }
+
+        uint32_t value = 0;
+        for(uint32_t i = 0; i < size; i++)
+            value |= read_page(addr + i)[(addr + i) & page_mask] << (i * 8);
+        return value;
+    }
+
+    void store_slow(uint32_t addr, uint32_t value, uint32_t size)
+    {
+        if(exceptions && (addr & (size - 1))) {
+            fault(addr, vectors::UNALIGNED);
+            return;
+        }
+
+        device *dev = l1[addr >> l1_shift]->devices[(addr >> page_shift) & l2_mask];
+        if(dev != NULL) {
+            dev->write(addr, value, size);
+            return;
+        }
+
+        if(!is_ram(addr, size)) {
+            fault(addr);
+            return;
+        }
+
+        for(uint32_t i = 0; i < size; i++)
+            allocate_page(addr + i)[(addr + i) & page_mask] = (value >> (i * 8)) & 0xff;
+        invalidate_decoded(addr, size);
+    }
+
+    uint32_t fetch32(uint32_t addr)
+    {
+        uint8_t *page = read_page(addr);
+        uint32_t offset = addr & page_mask;
+        if(page == NULL || (addr & 3))
+            return fetch_slow(addr, 4);
+
+        return
+            (page[offset + 0] << 0) | 
+            (page[offset + 1] << 8) | 
+            (page[offset + 2] << 16) | 
+            (page[offset + 3] << 24);
+    }
+
+    uint32_t fetch16(uint32_t addr)
+    {
+        uint8_t *page = read_page(addr);
+        uint32_t offset = addr & page_mask;
+        if(page == NULL || (addr & 1))
+            return fetch_slow(addr, 2);
+
+        return
+            (page[offset + 0] << 0) | 
+            (page[offset + 1] << 8);
+    }
+
+    uint32_t fetch8(uint32_t addr)
+    {
+        uint8_t *page = read_page(addr);
+        if(page == NULL)
+            return fetch_slow(addr, 1);
+
+        return page[addr & page_mask];
+    }
+
+    void store32(uint32_t addr, uint32_t value)
+    {
+        uint8_t *page = write_page(addr);
+        uint32_t offset = addr & page_mask;
+        if(page == NULL || (addr & 3)) {
+            store_slow(addr, value, 4);
+            return;
+        }
+
+        page[offset + 0] = (value >> 0) & 0xff;
+        page[offset + 1] = (value >> 8) & 0xff;
+        page[offset + 2] = (value >> 16) & 0xff;
+        page[offset + 3] = (value >> 24) & 0xff;
+        invalidate_decoded(addr, 4);
+    }
+
+    void store16(uint32_t addr, uint32_t value)
+    {
+        uint8_t *page = write_page(addr);
+        uint32_t offset = addr & page_mask;
+        if(page == NULL || (addr & 1)) {
+            store_slow(addr, value, 2);
+            return;
+        }
+
+        page[offset + 0] = (value >> 0) & 0xff;
+        page[offset + 1] = (value >> 8) & 0xff;
+        invalidate_decoded(addr, 2);
+    }
+
+    void store8(uint32_t addr, uint32_t value)
+    {
+        uint8_t *page = write_page(addr);
+        if(page == NULL) {
+            store_slow(addr, value, 1);
+            return;
+        }
+
+        page[addr & page_mask] = value & 0xff;
+        invalidate_decoded(addr, 1);
+    }
+
+    // The address space starts out empty; see map_ram() and map_device()
+    state() :
+        counts(NULL),
+        allocated_pages(0),
+        base_serial(0),
+        snapshots_taken(0)
+    {
+        for(uint32_t i = 0; i < l1_entries; i++)
+            l1[i] = &hole_table;
+        reset();
+    }
+
+    ~state()
+    {
+        for(uint32_t i = 0; i < l1_entries; i++) {
+            if(l1[i] == &hole_table || l1[i] == &zero_table)
+                continue;
+            for(uint32_t j = 0; j < l2_entries; j++)
+                release_page(*l1[i], j);
+            delete l1[i];
+        }
+    }
+
+    void reset()
+    {
+        separate_instructions = false;
+        program = NULL;
+        programsize = 0;
+        instructions = 0;
+        instruction_limit = ~0ULL;
+        run_limit = ~0ULL;
+        events.clear();
+        fuse = false;
+        memset(fusion_counts, 0, sizeof(fusion_counts));
+        invalidate_all_decoded();
+        memset(code_pages, 0, sizeof(code_pages));
+        code_dirty = false;
+        memory_fault = false;
+        fault_vector = vectors::BAD_ACCESS;
+        exceptions = false;
+        hypercalls = false;
+        trapped = false;
+        for(int i = 0; i < registercount; i++)
+            registers[i] = 0 ;
+        carry = 0;
+        lt = false;
+        eq = false;
+        gt = false;
+        halted = false;
+        registers[reg::PC] = 0x0;
+    }
+};
+
+// Runs from PC until halt, a fault or state::instruction_limit with every
+// opcode inlined and computed-goto dispatch; see simulator.cpp
+void run_threaded(state& s);
+
+#if defined(__x86_64__)
+
+// Basic-block translator to x86-64.  Straight-line register ALU ops are
+// emitted inline against the state struct (pointed to by rbx); everything
+// else, including all loads and stores so MMIO such as the console keeps
+// working, calls back into the opcodes[] handlers through jit_helper.
+// Blocks end at JMP/JNE/JL/JSR/JR/SYS/HALT or after jit_max_block
+// instructions, and check state::instruction_limit on entry, so a limit can
+// be overshot by up to one block.  Exits to a known PC return the address of
+// a patchable jump so the dispatcher can chain the block directly to its
+// successor.
+// A store to a page holding translated code sets code_dirty and the whole
+// translation buffer is thrown away before the next block runs.
+
+const size_t jit_buffer_size = 32 * 1024 * 1024;
+const int jit_max_block = 128;
+const size_t jit_max_block_bytes = jit_max_block * 96 + 256; // room for count_executed()
+const int jit_prologue_size = 4; // push rbx; mov rbx, rdi
+
+// Returns nonzero if the block has to stop after this instruction.
+extern "C" int jit_helper(state *s, const instruction *instr);
+
+struct x86_emitter
+{
+    uint8_t *p;
+    x86_emitter(uint8_t *p_) : p(p_) {}
+    void b(uint8_t v) { *p++ = v; }
+    void d(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+    void q(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+    // op with a [rbx + disp32] operand; reg is the register or /digit
+    void rbx_rm(uint8_t op, int reg, int32_t disp) { b(op); b(0x80 | (reg << 3) | 3); d(disp); }
+};
+
+inline int32_t reg_offset(uint r) { return offsetof(state, registers) + r * sizeof(int32_t); }
+
+struct jit
+{
+    typedef uint8_t *(*blockfunc)(state *);
+
+    uint8_t *buffer;
+    size_t used;
+    std::unordered_map<uint32_t, uint8_t *> blocks; // guest PC to block entry
+    std::deque<instruction> operands; // decoded instructions passed to jit_helper
+    unsigned long long generation; // bumped on flush so stale chain sites aren't patched
+    std::vector<uint32_t> marked_pages; // set in state::code_pages, cleared by flush
+
+    jit() : buffer(NULL), used(0), generation(0) {}
+
+    ~jit()
+    {
+        if(buffer != NULL)
+            munmap(buffer, jit_buffer_size);
+    }
+
+    bool init()
+    {
+        void *p = mmap(NULL, jit_buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+            return false;
+        buffer = (uint8_t *)p;
+        return true;
+    }
+
+    void flush(state& s)
+    {
+        used = 0;
+        blocks.clear();
+        operands.clear();
+        for(auto it = marked_pages.begin(); it != marked_pages.end(); it++)
+            s.code_pages[*it] = 0;
+        marked_pages.clear();
+        s.code_dirty = false;
+        generation++;
+    }
+
+    void count(x86_emitter& e, uint32_t n)
+    {
+        if(n == 0)
+            return;
+        e.b(0x48); e.rbx_rm(0x81, 0, offsetof(state, instructions)); e.d(n); // add qword [instructions], n
+    }
+
+    void exit_dynamic(x86_emitter& e, uint32_t n)
+    {
+        count(e, n);
+        e.b(0x31); e.b(0xc0); // xor eax, eax
+        e.b(0x5b); e.b(0xc3); // pop rbx; ret
+    }
+
+    void exit_chained(x86_emitter& e, uint32_t n, uint32_t target)
+    {
+        count(e, n);
+        uint8_t *site = e.p;
+        e.b(0xe9); e.d(0); // jmp rel32, falls through until chained
+        e.rbx_rm(0xc7, 0, reg_offset(reg::PC)); e.d(target); // mov dword [PC], target
+        e.b(0x48); e.b(0x8d); e.b(0x05); e.d(site - (e.p + 4)); // lea rax, [site]
+        e.b(0x5b); e.b(0xc3); // pop rbx; ret
+    }
+
+    // Adds one to an execution_counts slot for an instruction run inline;
+    // ones through jit_helper count themselves
+    void count_executed(x86_emitter& e, state& s, uint32_t pc, uint op)
+    {
+        if(s.counts == NULL)
+            return;
+        void *slots[] = { &s.counts->count(pc), &s.counts->opcode_counts[op] };
+        for(int i = 0; i < 2; i++) {
+            e.b(0x48); e.b(0xb8); e.q((uint64_t)slots[i]); // mov rax, imm64
+            e.b(0x48); e.b(0x83); e.b(0x00); e.b(0x01); // add qword [rax], 1
+        }
+    }
+
+    void set_pc(x86_emitter& e, uint32_t pc)
+    {
+        e.rbx_rm(0xc7, 0, reg_offset(reg::PC)); e.d(pc);
+    }
+
+    // Emits a call to jit_helper; if the helper reports a stop, the block
+    // exits after crediting the "pending" inline instructions before it.
+    void helper(x86_emitter& e, const instruction& instr, uint32_t pc, uint32_t pending, bool always_exits)
+    {
+        operands.push_back(instr);
+        set_pc(e, pc);
+        e.b(0x48); e.b(0x89); e.b(0xdf); // mov rdi, rbx
+        e.b(0x48); e.b(0xbe); e.q((uint64_t)&operands.back()); // mov rsi, imm64
+        e.b(0x48); e.b(0xb8); e.q((uint64_t)&jit_helper); // mov rax, imm64
+        e.b(0xff); e.b(0xd0); // call rax
+        if(always_exits) {
+            exit_dynamic(e, pending);
+            return;
+        }
+        e.b(0x85); e.b(0xc0); // test eax, eax
+        e.b(0x74); uint8_t *skip = e.p; e.b(0); // jz rel8
+        exit_dynamic(e, pending);
+        *skip = e.p - (skip + 1);
+    }
+
+    // Emits a register-only instruction inline; returns false if it has to
+    // go through the helper instead.
+    bool inline_alu(x86_emitter& e, const instruction& instr)
+    {
+        if(instr.dst == reg::PC || instr.src == reg::PC)
+            return false;
+
+        int32_t dst = reg_offset(instr.dst);
+        int32_t src = reg_offset(instr.src);
+
+        switch(instr.opcode) {
+            case opcode::MOVIU:
+                e.rbx_rm(0xc7, 0, dst); e.d(instr.data << 16);
+                return true;
+            case opcode::ADDI:
+                e.rbx_rm(0x81, 0, dst); e.d(instr.imm);
+                return true;
+            case opcode::ADDIU:
+                e.rbx_rm(0x81, 0, dst); e.d(instr.data);
+                return true;
+            case opcode::SHIFT:
+                if(instr.modifier == shifttype::RL || instr.modifier == shifttype::RA) {
+                    e.rbx_rm(0xc1, 7, dst); e.b(instr.data & 0x1f); // sar, registers are signed
+                } else if(instr.modifier == shifttype::LL || instr.modifier == shifttype::LA) {
+                    e.rbx_rm(0xc1, 4, dst); e.b(instr.data & 0x1f); // shl
+                }
+                return true;
+            case opcode::CMPIU:
+                e.rbx_rm(0x8b, 0, dst); // mov eax, [dst]
+                e.b(0x25); e.d(0xffffff); // and eax, 0xffffff
+                e.b(0x3d); e.d(instr.data); // cmp eax, imm32
+                e.b(0x0f); e.rbx_rm(0x94, 0, offsetof(state, eq)); // sete
+                e.b(0x0f); e.rbx_rm(0x92, 0, offsetof(state, lt)); // setb
+                e.b(0x0f); e.rbx_rm(0x97, 0, offsetof(state, gt)); // seta
+                return true;
+            case opcode::CMP:
+                e.rbx_rm(0x8b, 0, dst); // mov eax, [dst]
+                e.rbx_rm(0x3b, 0, src); // cmp eax, [src]
+                e.b(0x0f); e.rbx_rm(0x94, 0, offsetof(state, eq)); // sete
+                e.b(0x0f); e.rbx_rm(0x9c, 0, offsetof(state, lt)); // setl
+                e.b(0x0f); e.rbx_rm(0x9f, 0, offsetof(state, gt)); // setg
+                return true;
+            case opcode::MOV:
+                e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x89, 0, dst);
+                return true;
+            case opcode::NOT:
+                e.rbx_rm(0x8b, 0, src); e.b(0xf7); e.b(0xd0); e.rbx_rm(0x89, 0, dst);
+                return true;
+            case opcode::AND: e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x21, 0, dst); return true;
+            case opcode::OR: e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x09, 0, dst); return true;
+            case opcode::XOR: e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x31, 0, dst); return true;
+            case opcode::ADD: e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x01, 0, dst); return true;
+            case opcode::SUB: e.rbx_rm(0x8b, 0, src); e.rbx_rm(0x29, 0, dst); return true;
+        }
+        return false;
+    }
+
+    uint8_t *translate(state& s, uint32_t pc)
+    {
+        uint32_t word;
+        if(!s.peek_instruction(pc, &word) || opcodes[instruction(word).opcode].func == NULL || s.breakpoints.count(pc))
+            return NULL;
+
+        if(jit_buffer_size - used < jit_max_block_bytes)
+            flush(s);
+
+        uint8_t *entry = buffer + used;
+        x86_emitter e(entry);
+        e.b(0x53); // push rbx
+        e.b(0x48); e.b(0x89); e.b(0xfb); // mov rbx, rdi
+
+        // chained blocks enter here, so the limit is checked on every block
+        e.b(0x48); e.rbx_rm(0x8b, 0, offsetof(state, instructions)); // mov rax, [instructions]
+        e.b(0x48); e.rbx_rm(0x3b, 0, offsetof(state, instruction_limit)); // cmp rax, [instruction_limit]
+        e.b(0x72); uint8_t *below = e.p; e.b(0); // jb rel8
+        set_pc(e, pc);
+        exit_dynamic(e, 0);
+        *below = e.p - (below + 1);
+
+        uint32_t pending = 0; // inline instructions not yet added to s.instructions
+        uint32_t p = pc;
+        bool ended = false;
+
+        for(int n = 0; n < jit_max_block && !ended; n++, p += 4) {
+            // blocks end before a breakpoint so it's reached through the interpreter
+            if(!s.peek_instruction(p, &word) || (!s.breakpoints.empty() && s.breakpoints.count(p)))
+                break;
+            instruction instr(word);
+            if(opcodes[instr.opcode].func == NULL)
+                break;
+            int32_t offset = instr.imm << 2;
+
+            switch(instr.opcode) {
+                case opcode::JMP:
+                    count_executed(e, s, p, instr.opcode);
+                    exit_chained(e, pending + 1, offset);
+                    ended = true;
+                    break;
+                case opcode::JSR:
+                    if(instr.dst == reg::PC) {
+                        helper(e, instr, p, pending, true);
+                    } else {
+                        count_executed(e, s, p, instr.opcode);
+                        e.rbx_rm(0xc7, 0, reg_offset(instr.dst)); e.d(p + 4);
+                        exit_chained(e, pending + 1, p + offset);
+                    }
+                    ended = true;
+                    break;
+                case opcode::JNE:
+                case opcode::JL: {
+                    bool jl = instr.opcode == opcode::JL;
+                    count_executed(e, s, p, instr.opcode);
+                    e.rbx_rm(0x80, 7, jl ? offsetof(state, lt) : offsetof(state, eq)); e.b(0); // cmp byte, 0
+                    e.b(0x0f); e.b(0x85); uint8_t *flag_set = e.p; e.d(0); // jne rel32
+                    exit_chained(e, pending + 1, jl ? p + 4 : p + offset);
+                    uint32_t rel = e.p - (flag_set + 4);
+                    memcpy(flag_set, &rel, 4);
+                    exit_chained(e, pending + 1, jl ? p + offset : p + 4);
+                    ended = true;
+                    break;
+                }
+                case opcode::JR:
+                    count_executed(e, s, p, instr.opcode);
+                    set_pc(e, p);
+                    e.rbx_rm(0x8b, 0, reg_offset(instr.dst)); // mov eax, [dst]
+                    e.b(0x05); e.d(offset); // add eax, imm32
+                    e.rbx_rm(0x89, 0, reg_offset(reg::PC)); // mov [PC], eax
+                    exit_dynamic(e, pending + 1);
+                    ended = true;
+                    break;
+                case opcode::SYS:
+                case opcode::HALT:
+                    helper(e, instr, p, pending, true);
+                    ended = true;
+                    break;
+                default:
+                    if(inline_alu(e, instr)) {
+                        count_executed(e, s, p, instr.opcode);
+                        pending++;
+                    } else {
+                        helper(e, instr, p, pending, false);
+                        // the helper counted itself; pending instructions
+                        // are credited at whichever exit is taken
+                    }
+                    break;
+            }
+        }
+        if(!ended)
+            exit_chained(e, pending, p);
+
+        if(!s.separate_instructions)
+            for(uint32_t page = pc >> page_shift; page <= (p - 1) >> page_shift; page++)
+                if(!s.code_pages[page]) {
+                    s.code_pages[page] = 1;
+                    marked_pages.push_back(page);
+                }
+
+        used = e.p - buffer;
+        blocks[pc] = entry;
+        return entry;
+    }
+
+    uint8_t *lookup(state& s, uint32_t pc)
+    {
+        auto it = blocks.find(pc);
+        return (it != blocks.end()) ? it->second : translate(s, pc);
+    }
+
+    void run(state& s)
+    {
+        while(!s.halted && !s.memory_fault && s.instructions < s.instruction_limit) {
+            if(s.code_dirty)
+                flush(s);
+
+            uint32_t pc = s.registers[reg::PC];
+            uint8_t *entry = lookup(s, pc);
+            if(entry == NULL) {
+                // can't translate here, e.g. at a breakpoint; let the
+                // interpreter take one step
+                const decoded_instruction& d = s.decode(pc);
+                if(s.memory_fault)
+                    return;
+                unsigned long long before = s.instructions;
+                uint first = d.instr.opcode, second = d.fused ? d.second.opcode : 0;
+                if(s.use_fused(d))
+                    d.fused(s, d);
+                else
+                    d.func(s, d.instr);
+                if(!s.memory_fault)
+                    s.instructions++;
+                if(s.counts)
+                    s.counts->add(pc, first, second, s.instructions - before);
+                if(s.memory_fault)
+                    return;
+                continue;
+            }
+
+            uint8_t *site = ((blockfunc)entry)(&s);
+            if(site == NULL || s.code_dirty)
+                continue;
+
+            unsigned long long before = generation;
+            uint8_t *next = lookup(s, s.registers[reg::PC]);
+            if(next != NULL && generation == before) {
+                int32_t rel = (next + jit_prologue_size) - (site + 5);
+                memcpy(site + 1, &rel, 4);
+            }
+        }
+    }
+};
+
+#endif
+
+// Guest console.  Bytes stored to OUTPUT, or a whole string described by
+// STRING_ADDRESS and then STRING_LENGTH, collect in a host buffer that is
+// written to fd according to the flush policy and always at flush().
+// With fd -1 flushed output is kept in captured instead.
+struct console_device : public device
+{
+    enum {
+        OUTPUT = 0x0,
+        STRING_ADDRESS = 0x4,
+        STRING_LENGTH = 0x8, // storing a length emits that many bytes
+    };
+
+    enum flush_policy {
+        FLUSH_NEWLINE,  // at each newline or when the buffer fills
+        FLUSH_SIZE,     // when the buffer fills
+        FLUSH_HALT,     // only when flushed explicitly, e.g. at halt
+    };
+
+    state& s;
+    uint32_t address;
+    int fd;
+    flush_policy policy;
+    size_t buffer_size;
+    std::vector<char> buffer;
+    uint32_t string_address;
+    std::string captured;
+
+    console_device(state& s_, uint32_t address_, int fd_, flush_policy policy_, size_t buffer_size_) :
+        s(s_),
+        address(address_),
+        fd(fd_),
+        policy(policy_),
+        buffer_size(buffer_size_),
+        string_address(0)
+    {
+        buffer.reserve(buffer_size);
+    }
+
+    virtual ~console_device() { flush(); }
+
+    virtual uint32_t read(uint32_t addr, uint32_t size)
+    {
+        if(addr - address == STRING_ADDRESS)
+            return string_address;
+        return 0;
+    }
+
+    virtual void write(uint32_t addr, uint32_t value, uint32_t size)
+    {
+        switch(addr - address) {
+            case OUTPUT: {
+                char c = value & 0xff;
+                buffer.push_back(c);
+                written(c == '\n');
+                break;
+            }
+            case STRING_ADDRESS:
+                string_address = value;
+                break;
+            case STRING_LENGTH: {
+                // the guest picks the length, so copy at most a buffer's
+                // worth at a time and stop at the end of RAM or the top of
+                // the address space
+                const uint32_t chunk = std::min(std::max(buffer_size, (size_t)256), (size_t)1 << 20);
+                uint32_t addr = string_address;
+                uint32_t left = value;
+                while(left > 0) {
+                    uint32_t n = std::min(left, chunk);
+                    size_t old = buffer.size();
+                    buffer.resize(old + n);
+                    uint32_t copied = s.read_block(addr, (uint8_t *)&buffer[old], n);
+                    buffer.resize(old + copied);
+                    if(copied > 0)
+                        written(memchr(&buffer[old], '\n', copied) != NULL);
+                    if(copied < n || uint64_t(addr) + n >= ((uint64_t)1 << 32))
+                        break;
+                    addr += n;
+                    left -= n;
+                }
+                break;
+            }
+        }
+    }
+
+    void written(bool newline)
+    {
+        if((policy == FLUSH_NEWLINE && newline) ||
+            (policy != FLUSH_HALT && buffer.size() >= buffer_size))
+            flush();
+    }
+
+    void flush()
+    {
+        if(buffer.empty())
+            return;
+        if(fd < 0) {
+            captured.append(buffer.begin(), buffer.end());
+            buffer.clear();
+            return;
+        }
+        if(fd == STDOUT_FILENO)
+            fflush(stdout); // keep our own printf()s in order
+        size_t done = 0;
+        while(done < buffer.size()) {
+            ssize_t n = ::write(fd, &buffer[done], buffer.size() - done);
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                break;
+            }
+            done += n;
+        }
+        buffer.clear();
+    }
+};
+
+// Instruction-count timer and interrupt controller.  Ticks and deliveries
+// are state events, so the engines only notice them between blocks and an
+// idle timer costs nothing.  Other devices raise() their own lines.
+struct interrupt_controller : public device, public event_source
+{
+    enum {
+        TIMER_PERIOD = 0x0,
+        TIMER_COUNT = 0x4,
+        PENDING = 0x8,
+        ENABLE = 0xc,
+        CONTROL = 0x10,
+    };
+
+    enum { TICK, DELIVER }; // event kinds
+
+    state& s;
+    uint32_t address;
+    uint32_t period;
+    unsigned long long next_tick;
+    uint32_t pending;
+    uint32_t enabled;
+    bool taking; // CONTROL bit 0
+
+    interrupt_controller(state& s_, uint32_t address_) :
+        s(s_),
+        address(address_),
+        period(0),
+        next_tick(0),
+        pending(0),
+        enabled(0),
+        taking(false)
+    {}
+
+    virtual uint32_t read(uint32_t addr, uint32_t size)
+    {
+        switch(addr - address) {
+            case TIMER_PERIOD: return period;
+            case TIMER_COUNT: return s.instructions;
+            case PENDING: return pending;
+            case ENABLE: return enabled;
+            case CONTROL: return taking ? 1 : 0;
+        }
+        return 0;
+    }
+
+    virtual void write(uint32_t addr, uint32_t value, uint32_t size)
+    {
+        switch(addr - address) {
+            case TIMER_PERIOD:
+                period = value;
+                s.unschedule(this, TICK);
+                next_tick = s.instructions + period;
+                if(period != 0)
+                    s.schedule(next_tick, this, TICK);
+                break;
+            case PENDING:
+                pending &= ~value;
+                break;
+            case ENABLE:
+                enabled = value;
+                check();
+                break;
+            case CONTROL:
+                taking = value & 1;
+                check();
+                break;
+        }
+    }
+
+    void raise(uint32_t lines)
+    {
+        pending |= lines;
+        check();
+    }
+
+    // Asks for a delivery at the next block boundary if one is due
+    void check()
+    {
+        if(taking && (pending & enabled))
+            s.schedule(s.instructions, this, DELIVER);
+    }
+
+    virtual void event(state&, int kind)
+    {
+        if(kind == TICK) {
+            // from the deadline, not from when a block boundary got here
+            next_tick += period;
+            s.schedule(next_tick, this, TICK);
+            raise(interrupt::TIMER);
+            return;
+        }
+
+        // the guest may have masked the line, or taken it, since check()
+        if(!taking || !(pending & enabled) || s.halted || s.memory_fault)
+            return;
+        uint32_t sp = s.registers[reg::SP] - 4;
+        s.store32(sp, s.registers[reg::PC] - 4);
+        if(s.memory_fault)
+            return;
+        s.registers[reg::SP] = sp;
+        s.registers[reg::PC] = vectors::INTERRUPT;
+        taking = false;
+    }
+};
+
+// Block storage on a host image file mapped shared, so writes reach the
+// file.  The guest sets SECTOR, ADDRESS and COUNT and stores a command;
+// the whole transfer is one copy between the mapping and guest RAM, done
+// latency instructions later, when STATUS leaves BUSY and interrupt::DISK
+// is raised.  Guest RAM mustn't be touched until then.
+struct disk_device : public device, public event_source
+{
+    enum {
+        SECTOR = 0x0,
+        ADDRESS = 0x4,
+        COUNT = 0x8, // sectors
+        COMMAND = 0xc,
+        STATUS = 0x10,
+        SECTORS = 0x14, // size of the image, read-only
+    };
+
+    state& s;
+    uint32_t address;
+    interrupt_controller& interrupts;
+    unsigned int latency;
+    uint8_t *image;
+    size_t image_size;
+    uint32_t sector, dma_address, count, command, status;
+
+    disk_device(state& s_, uint32_t address_, interrupt_controller& interrupts_, unsigned int latency_) :
+        s(s_),
+        address(address_),
+        interrupts(interrupts_),
+        latency(latency_),
+        image(NULL),
+        image_size(0),
+        sector(0),
+        dma_address(0),
+        count(0),
+        command(0),
+        status(disk::IDLE)
+    {}
+
+    virtual ~disk_device()
+    {
+        if(image != NULL)
+            munmap(image, image_size);
+    }
+
+    // Maps filename read-write; whole sectors of it are the disk
+    bool open(const char *filename)
+    {
+        int fd = ::open(filename, O_RDWR);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        image_size = ok ? st.st_size / disk::SECTOR_SIZE * disk::SECTOR_SIZE : 0;
+        if(ok && image_size > 0) {
+            void *p = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ok = p != MAP_FAILED;
+            image = ok ? (uint8_t *)p : NULL;
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return ok;
+    }
+
+    virtual uint32_t read(uint32_t addr, uint32_t size)
+    {
+        switch(addr - address) {
+            case SECTOR: return sector;
+            case ADDRESS: return dma_address;
+            case COUNT: return count;
+            case STATUS: return status;
+            case SECTORS: return image_size / disk::SECTOR_SIZE;
+        }
+        return 0;
+    }
+
+    virtual void write(uint32_t addr, uint32_t value, uint32_t size)
+    {
+        switch(addr - address) {
+            case SECTOR: sector = value; break;
+            case ADDRESS: dma_address = value; break;
+            case COUNT: count = value; break;
+            case COMMAND:
+                if(status == disk::BUSY)
+                    break;
+                command = value;
+                status = disk::BUSY;
+                s.schedule(s.instructions + latency, this, 0);
+                break;
+        }
+    }
+
+    virtual void event(state&, int)
+    {
+        uint64_t offset = (uint64_t)sector * disk::SECTOR_SIZE;
+        uint64_t bytes = (uint64_t)count * disk::SECTOR_SIZE;
+        status = disk::ERROR;
+        if(offset + bytes <= image_size && bytes <= 0xffffffff && is_ram_range(dma_address, bytes)) {
+            if(command == disk::READ) {
+                s.write_block(dma_address, image + offset, bytes);
+                status = disk::DONE;
+            } else if(command == disk::WRITE) {
+                s.read_block(dma_address, image + offset, bytes);
+                status = disk::DONE;
+            }
+        }
+        interrupts.raise(interrupt::DISK);
+    }
+
+    // Like state::check_ram() but without faulting; DMA errors are
+    // reported in STATUS
+    bool is_ram_range(uint32_t addr, uint32_t len)
+    {
+        if(len == 0)
+            return true;
+        uint32_t last = addr + len - 1;
+        if(last < addr)
+            return false;
+        for(uint32_t a = addr; ; a = (a & ~page_mask) + page_size) {
+            if(s.read_page(a) == NULL)
+                return false;
+            if((a >> page_shift) == (last >> page_shift))
+                return true;
+        }
+    }
+};
+
+// Snapshot files hold a snapshot_header and then, for each RAM page that
+// isn't all zero, its page number and page_size bytes, all in host byte
+// order like BIN images.  Pages a file doesn't name are zero.
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t registers[registercount];
+    uint32_t flags; // lt, eq, gt, halted, carry, memory_fault from bit 0
+    uint32_t fault_address;
+    uint64_t instructions;
+    uint32_t page_shift;
+    uint32_t page_count;
+};
+
+bool write_snapshot(const snapshot& snap, const char *filename);
+
+// Loads a snapshot file into a state whose RAM is mapped and still zero;
+// returns an error message, or NULL on success
+const char *read_snapshot(state& s, const char *filename);
+
+// Writes a binary trace; see trace.hpp.  The interpreter only encodes;
+// full chunks go to a background thread that compresses and writes them.
+struct trace_writer
+{
+    FILE *fp;
+    bool compress;
+    std::unique_ptr<trace::encoder> encoder;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable queued; // a chunk is waiting, or done is set
+    std::condition_variable taken; // there's room in queue again
+    std::deque<std::vector<uint8_t> > queue;
+    bool done;
+    bool failed;
+
+    static const size_t max_queued = 4; // the interpreter waits beyond this
+
+    trace_writer() : fp(NULL), compress(false), done(false), failed(false) {}
+    ~trace_writer() { close(); }
+
+    bool open(const char *filename, bool compress_, const int32_t *registers)
+    {
+        fp = fopen(filename, "wb");
+        if(fp == NULL)
+            return false;
+        compress = compress_;
+
+        trace::trace_header h;
+        memcpy(h.magic, trace::magic, sizeof(h.magic));
+        h.flags = compress ? trace::COMPRESSED : 0;
+        memcpy(h.registers, registers, sizeof(h.registers));
+        if(fwrite(&h, sizeof(h), 1, fp) != 1)
+            return false;
+
+        encoder.reset(new trace::encoder(registers));
+        thread = std::thread(&trace_writer::write_chunks, this);
+        return true;
+    }
+
+    // Call after each instruction executed at pc
+    void record(state& s, uint32_t pc, memory_changed change)
+    {
+        // as at --verbose 3, only RAM is read back, never a device
+        bool has_value = change.first && s.is_ram(change.second, 4);
+        encoder->record(pc, s.registers, change.first, change.second, has_value, has_value ? s.fetch32(change.second) : 0);
+        if(encoder->full())
+            ship();
+    }
+
+    void ship()
+    {
+        if(encoder->used == 0)
+            return;
+        std::vector<uint8_t> chunk(encoder->chunk.begin(), encoder->chunk.begin() + encoder->used);
+        encoder->used = 0;
+
+        std::unique_lock<std::mutex> guard(lock);
+        while(queue.size() >= max_queued)
+            taken.wait(guard);
+        queue.push_back(std::vector<uint8_t>());
+        queue.back().swap(chunk);
+        queued.notify_one();
+    }
+
+    void write_chunks()
+    {
+        std::vector<uint8_t> compressed;
+        for(;;) {
+            std::vector<uint8_t> chunk;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                while(queue.empty() && !done)
+                    queued.wait(guard);
+                if(queue.empty())
+                    return;
+                chunk.swap(queue.front());
+                queue.pop_front();
+                taken.notify_one();
+            }
+
+            trace::trace_chunk c;
+            c.size = chunk.size();
+            const uint8_t *data = &chunk[0];
+            c.stored = c.size;
+            if(compress) {
+                uLongf size = compressBound(c.size);
+                compressed.resize(size);
+                if(compress2(&compressed[0], &size, data, c.size, 1) != Z_OK) {
+                    failed = true;
+                    continue;
+                }
+                data = &compressed[0];
+                c.stored = size;
+            }
+            if(fwrite(&c, sizeof(c), 1, fp) != 1 || fwrite(data, c.stored, 1, fp) != 1)
+                failed = true;
+        }
+    }
+
+    // Writes what's left; false if anything couldn't be written
+    bool close()
+    {
+        if(fp == NULL)
+            return true;
+        if(encoder)
+            ship();
+        if(thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                done = true;
+                queued.notify_one();
+            }
+            thread.join();
+        }
+        bool ok = (fclose(fp) == 0) && !failed;
+        fp = NULL;
+        return ok;
+    }
+};
+
+// Guest profile: exact counts per PC and per opcode, which the engines
+// keep through state::counts, and a call tree the stepping loop charges
+// each instruction to, rebuilt from JSR and JR: JSR enters the callee,
+// and a JR to a return address on the shadow stack returns to that
+// caller; any other JR is a jump within the function.
+struct profiler
+{
+    struct node
+    {
+        uint32_t function; // entry PC
+        uint32_t parent;
+        unsigned long long instructions; // executed in this function here
+    };
+
+    struct call
+    {
+        uint32_t caller; // node
+        uint32_t return_address;
+    };
+
+    execution_counts counts;
+    std::vector<node> nodes; // nodes[0] is the entry point
+    std::unordered_map<uint64_t, uint32_t> children; // parent << 32 | function
+    std::vector<call> stack;
+    uint32_t current;
+
+    profiler(uint32_t entry) : current(0)
+    {
+        node root = { entry, 0, 0 };
+        nodes.push_back(root);
+    }
+
+    // Call after executing instr at pc; next is the PC it left
+    void executed(uint32_t pc, const instruction& instr, uint32_t next)
+    {
+        nodes[current].instructions++;
+
+        if(instr.opcode == opcode::JSR) {
+            call c = { current, pc + 4 };
+            stack.push_back(c);
+            uint64_t key = ((uint64_t)current << 32) | next;
+            auto it = children.find(key);
+            if(it == children.end()) {
+                node n = { next, current, 0 };
+                nodes.push_back(n);
+                it = children.insert(std::make_pair(key, (uint32_t)(nodes.size() - 1))).first;
+            }
+            current = it->second;
+        } else if(instr.opcode == opcode::JR) {
+            for(size_t depth = stack.size(); depth > 0; depth--)
+                if(stack[depth - 1].return_address == next) {
+                    current = stack[depth - 1].caller;
+                    stack.resize(depth - 1);
+                    break;
+                }
+        }
+    }
+
+    // Opcode totals, then the hottest PCs, then the hottest runs of
+    // consecutive PCs executed equally often, i.e. basic blocks
+    void write_report(FILE *fp, state& s, size_t top)
+    {
+        unsigned long long total = 0;
+        for(int i = 0; i < 32; i++)
+            total += counts.opcode_counts[i];
+        double percent = total ? 100.0 / total : 0;
+
+        std::vector<std::pair<unsigned long long, int> > ops;
+        for(int i = 0; i < 32; i++)
+            if(counts.opcode_counts[i] > 0)
+                ops.push_back(std::make_pair(counts.opcode_counts[i], i));
+        std::sort(ops.rbegin(), ops.rend());
+        fprintf(fp, "%llu instructions\n\nopcode     count        %%\n", total);
+        for(size_t i = 0; i < ops.size(); i++)
+            fprintf(fp, "%-10s %-12llu %5.1f\n", opcodes[ops[i].second].name ? opcodes[ops[i].second].name : "unused",
+                ops[i].first, ops[i].first * percent);
+
+        std::vector<std::pair<unsigned long long, uint32_t> > pcs;
+        std::vector<std::pair<unsigned long long, std::pair<uint32_t, uint32_t> > > blocks; // instructions, first and last PC
+        for(uint32_t i = 0; i < l1_entries; i++) {
+            if(counts.l1[i] == NULL)
+                continue;
+            for(uint32_t j = 0; j < l2_entries; j++) {
+                if(counts.l1[i][j] == NULL)
+                    continue;
+                for(uint32_t k = 0; k < execution_counts::words_per_page; k++) {
+                    uint64_t n = counts.l1[i][j][k];
+                    if(n == 0)
+                        continue;
+                    uint32_t pc = (i << l1_shift) | (j << page_shift) | (k * 4);
+                    pcs.push_back(std::make_pair(n, pc));
+                    if(!blocks.empty() && blocks.back().second.second == pc - 4 && counts.count(pc - 4) == n) {
+                        blocks.back().first += n;
+                        blocks.back().second.second = pc;
+                    } else
+                        blocks.push_back(std::make_pair(n, std::make_pair(pc, pc)));
+                }
+            }
+        }
+
+        std::sort(pcs.rbegin(), pcs.rend());
+        fprintf(fp, "\npc         count        %%      instruction\n");
+        for(size_t i = 0; i < pcs.size() && i < top; i++) {
+            uint32_t word;
+            const char *name = "?";
+            if(s.peek_instruction(pcs[i].second, &word) && opcodes[instruction(word).opcode].name != NULL)
+                name = opcodes[instruction(word).opcode].name;
+            fprintf(fp, "%08X   %-12llu %5.1f  %s\n", pcs[i].second, pcs[i].first, pcs[i].first * percent, name);
+        }
+
+        std::sort(blocks.rbegin(), blocks.rend());
+        fprintf(fp, "\nblock               runs         instructions %%\n");
+        for(size_t i = 0; i < blocks.size() && i < top; i++) {
+            uint32_t first = blocks[i].second.first, last = blocks[i].second.second;
+            fprintf(fp, "%08X-%08X   %-12llu %-12llu %5.1f\n", first, last, (unsigned long long)counts.count(first),
+                blocks[i].first, blocks[i].first * percent);
+        }
+    }
+
+    // One line per call path, root first, in the "collapsed" format
+    // flame graph tools read: "0x00000040;0x00000100 1234"
+    void write_stacks(FILE *fp)
+    {
+        for(size_t i = 0; i < nodes.size(); i++) {
+            if(nodes[i].instructions == 0)
+                continue;
+            std::vector<uint32_t> path;
+            for(uint32_t n = i; ; n = nodes[n].parent) {
+                path.push_back(nodes[n].function);
+                if(n == 0)
+                    break;
+            }
+            for(size_t j = path.size(); j > 0; j--)
+                fprintf(fp, "%s0x%08x", (j < path.size()) ? ";" : "", path[j - 1]);
+            fprintf(fp, " %llu\n", nodes[i].instructions);
+        }
+    }
+};
+
+// Set-associative cache with LRU replacement; only tags are modelled.
+// A cache of size 0 misses every time.
+struct cache_model
+{
+    uint32_t size, line, ways;
+    uint32_t line_shift;
+    uint32_t sets;
+    std::vector<uint32_t> tags; // per set, most recently used first; ~0 is empty
+    unsigned long long hits, misses;
+
+    cache_model() : size(0), line(16), ways(1), line_shift(4), sets(0), hits(0), misses(0) {}
+
+    // "SIZE:LINE:WAYS" in bytes, e.g. "4096:16:2"; sizes must be powers of two
+    bool configure(const std::string& spec)
+    {
+        if(sscanf(spec.c_str(), "%u:%u:%u", &size, &line, &ways) != 3 && spec != "0")
+            return false;
+        if(size == 0)
+            return true;
+        if(line < 4 || (line & (line - 1)) != 0 || ways == 0 || size % (line * ways) != 0)
+            return false;
+        sets = size / (line * ways);
+        if((sets & (sets - 1)) != 0)
+            return false;
+        for(line_shift = 0; (1u << line_shift) < line; line_shift++);
+        tags.assign(sets * ways, ~0u);
+        return true;
+    }
+
+    bool access(uint32_t addr)
+    {
+        if(sets == 0) {
+            misses++;
+            return false;
+        }
+        uint32_t tag = addr >> line_shift;
+        uint32_t *set = &tags[(tag & (sets - 1)) * ways];
+        for(uint32_t i = 0; i < ways; i++)
+            if(set[i] == tag) {
+                memmove(set + 1, set, i * sizeof(uint32_t));
+                set[0] = tag;
+                hits++;
+                return true;
+            }
+        memmove(set + 1, set, (ways - 1) * sizeof(uint32_t));
+        set[0] = tag;
+        misses++;
+        return false;
+    }
+
+    void report(FILE *fp, const char *name)
+    {
+        unsigned long long total = hits + misses;
+        if(size == 0)
+            fprintf(fp, "%s: none, %llu accesses\n", name, total);
+        else
+            fprintf(fp, "%s: %u bytes, %u-byte lines, %u-way: %.2f%% hits (%llu of %llu)\n", name, size, line, ways,
+                total ? 100.0 * hits / total : 0.0, hits, total);
+    }
+};
+
+// Cycle-approximate model of a simple in-order pipeline like the FPGA
+// implementation: one instruction per cycle plus extra cycles for
+// multi-cycle opcodes, cache misses, taken branches and a load whose
+// result is used by the next instruction.  Device accesses bypass the
+// D-cache and take one cycle.
+struct timing_model
+{
+    cache_model icache, dcache;
+    unsigned int memory_latency; // cycles per cache miss
+    unsigned int branch_penalty; // taken JNE or JL, and JR
+    unsigned int jump_penalty; // JMP and JSR, resolved at decode
+    unsigned int load_use_penalty;
+    unsigned int latency[32]; // extra execute cycles per opcode
+
+    unsigned long long cycles, instructions;
+    unsigned long long latency_stalls, branch_stalls, load_use_stalls, icache_stalls, dcache_stalls;
+    uint32_t loaded; // register mask written by the previous instruction if it loaded
+
+    timing_model() :
+        memory_latency(10),
+        branch_penalty(2),
+        jump_penalty(1),
+        load_use_penalty(1),
+        cycles(0), instructions(0),
+        latency_stalls(0), branch_stalls(0), load_use_stalls(0), icache_stalls(0), dcache_stalls(0),
+        loaded(0)
+    {
+        memset(latency, 0, sizeof(latency));
+        latency[opcode::MULT] = 3;
+        latency[opcode::DIV] = 31;
+    }
+
+    // Registers instr reads, as a mask; push and sys address memory
+    // through registers[reg::SP - 4] as their handlers do
+    static uint32_t reads(const instruction& instr)
+    {
+        switch(instr.opcode) {
+            case opcode::AND: case opcode::OR: case opcode::XOR: case opcode::ADD:
+            case opcode::ADC: case opcode::SUB: case opcode::MULT: case opcode::DIV:
+            case opcode::CMP: case opcode::XCHG: case opcode::STORE:
+                return (1 << instr.dst) | (1 << instr.src);
+            case opcode::NOT: case opcode::MOV: case opcode::LOAD:
+                return 1 << instr.src;
+            case opcode::ADDI: case opcode::ADDIU: case opcode::CMPIU: case opcode::SHIFT:
+            case opcode::JR: case opcode::SWAPCC:
+                return 1 << instr.dst;
+            case opcode::PUSH:
+                return (1 << instr.dst) | (1 << (reg::SP - 4)) | (1 << reg::SP);
+            case opcode::POP:
+                return 1 << reg::SP;
+            case opcode::SYS:
+                return (1 << (reg::SP - 4)) | (1 << reg::SP);
+        }
+        return 0;
+    }
+
+    // Call before executing instr at pc, while registers hold its inputs
+    void before(state& s, uint32_t pc, const instruction& instr)
+    {
+        instructions++;
+        cycles += 1 + latency[instr.opcode];
+        latency_stalls += latency[instr.opcode];
+
+        if(!icache.access(pc)) {
+            cycles += memory_latency;
+            icache_stalls += memory_latency;
+        }
+
+        if(loaded & reads(instr)) {
+            cycles += load_use_penalty;
+            load_use_stalls += load_use_penalty;
+        }
+        loaded = 0;
+
+        bool accesses = true;
+        uint32_t addr = 0;
+        switch(instr.opcode) {
+            case opcode::LOAD: addr = s.registers[instr.src] + instr.imm; loaded = 1 << instr.dst; break;
+            case opcode::POP: addr = s.registers[reg::SP]; loaded = 1 << instr.dst; break;
+            case opcode::STORE: addr = s.registers[instr.dst] + instr.imm; break;
+            case opcode::PUSH: case opcode::SYS: addr = s.registers[reg::SP - 4]; break;
+            default: accesses = false; break;
+        }
+        if(accesses && s.is_ram(addr, 1) && !dcache.access(addr)) {
+            cycles += memory_latency;
+            dcache_stalls += memory_latency;
+        }
+    }
+
+    // Call after executing instr at pc; next is the PC it left
+    void after(uint32_t pc, const instruction& instr, uint32_t next)
+    {
+        unsigned int penalty = 0;
+        switch(instr.opcode) {
+            case opcode::JNE: case opcode::JL:
+                if(next != pc + 4)
+                    penalty = branch_penalty;
+                break;
+            case opcode::JR: case opcode::SYS:
+                penalty = branch_penalty;
+                break;
+            case opcode::JMP: case opcode::JSR:
+                penalty = jump_penalty;
+                break;
+        }
+        cycles += penalty;
+        branch_stalls += penalty;
+    }
+
+    void report(FILE *fp)
+    {
+        fprintf(fp, "%llu cycles, %llu instructions, CPI %.3f\n", cycles, instructions,
+            instructions ? (double)cycles / instructions : 0.0);
+        fprintf(fp, "stall cycles: %llu execute, %llu branch, %llu load-use, %llu I-cache, %llu D-cache\n",
+            latency_stalls, branch_stalls, load_use_stalls, icache_stalls, dcache_stalls);
+        icache.report(fp, "I-cache");
+        dcache.report(fp, "D-cache");
+    }
+};
+
+// Maps a BIN image copy-on-write, so the guest runs from the page cache
+// and its stores never reach the file; NULL on failure
+uint8_t *map_image(const char *filename, size_t *size);
+
+// Reads a whole stream in large blocks, for images piped to stdin
+std::vector<uint8_t> read_image(FILE *fp);
+
+enum VerbosityLevel {
+    ERROR = 0,
+    WARNING = 1,
+    INFO = 2,
+    DEBUG = 3,
+};
+
+struct sim_options
+{
+    int verbosity;
+    bool harvard;
+    bool exceptions; // see state::exceptions
+    bool hypercalls;
+    std::string disk_name; // block device image, if any
+    unsigned int disk_latency; // instructions from a disk command to its completion
+    bool threaded;
+    bool use_jit;
+    std::string trace_name; // binary trace file, if any
+    bool trace_compress;
+    std::string profile_name; // hot-spot report, if any
+    std::string stacks_name; // collapsed call stacks, if any
+    size_t profile_top;
+    bool timing; // run the timing model and report cycles
+    std::string icache, dcache; // cache_model::configure() specs
+    unsigned int memory_latency;
+    unsigned int branch_penalty;
+    bool no_fusion;
+    int console_fd; // -1 captures console output in the simulator
+    console_device::flush_policy console_policy;
+    size_t console_buffer;
+    uint64_t memory_mib;
+    unsigned long long max_instructions;
+
+    sim_options() :
+        verbosity(VerbosityLevel::ERROR),
+        harvard(false),
+        exceptions(false),
+        hypercalls(false),
+        disk_latency(1000),
+        threaded(false),
+        use_jit(false),
+        trace_compress(false),
+        profile_top(50),
+        timing(false),
+        icache("4096:16:1"),
+        dcache("4096:16:1"),
+        memory_latency(10),
+        branch_penalty(2),
+        no_fusion(false),
+        console_fd(STDOUT_FILENO),
+        console_policy(console_device::FLUSH_SIZE),
+        console_buffer(64 * 1024),
+        memory_mib(4096),
+        max_instructions(~0ULL)
+    {}
+
+    // Whether every instruction has to go through the stepping loop, one
+    // at a time, to be printed, traced, timed or charged to a call stack;
+    // every engine keeps the --profile counts
+    bool stepping() const
+    {
+        return verbosity >= VerbosityLevel::DEBUG || !trace_name.empty() ||
+            !stacks_name.empty() || timing;
+    }
+};
+
+// One guest machine and everything it owns, so several can run at once
+// on different threads.  The image passed to load() must outlive run().
+struct simulator
+{
+    sim_options options;
+    state s;
+    console_device console;
+    interrupt_controller interrupts;
+    std::unique_ptr<disk_device> disk; // see attach_disk()
+#if defined(__x86_64__)
+    jit translator;
+#endif
+    std::unique_ptr<trace_writer> tracer; // see start_trace()
+    std::unique_ptr<profiler> profile; // see start_profile()
+    std::unique_ptr<timing_model> timing; // see start_timing()
+
+    simulator(const sim_options& options_) :
+        options(options_),
+        console(s, mmio::CONSOLE_OUTPUT, options.console_fd, options.console_policy, options.console_buffer),
+        interrupts(s, mmio::TIMER_PERIOD)
+    {
+        options.memory_mib = std::min(options.memory_mib, (uint64_t)4096);
+        s.map_ram(0, options.memory_mib * 1024 * 1024);
+        s.map_device(mmio::CONSOLE_OUTPUT & ~page_mask, page_size, &console);
+        s.map_device(mmio::TIMER_PERIOD & ~page_mask, page_size, &interrupts);
+        s.fuse = !options.no_fusion && !options.stepping();
+        s.exceptions = options.exceptions;
+        s.hypercalls = options.hypercalls;
+        s.set_limit(options.max_instructions);
+    }
+
+    // "mapped" images are private host memory handed straight to the page
+    // tables; anything else is copied in.  False if a segmented image is
+    // malformed or has a segment outside RAM.
+    bool load(uint8_t *image, size_t imagesize, bool mapped)
+    {
+        if(imagesize >= sizeof(segment::header) && memcmp(image, segment::MAGIC, sizeof(segment::MAGIC)) == 0)
+            return load_segments(image, imagesize, mapped);
+
+        if(options.harvard) {
+            s.separate_instructions = true;
+            s.program = (uint32_t *)image;
+            s.programsize = imagesize / 4;
+        } else {
+            uint64_t loadsize = std::min((uint64_t)imagesize, options.memory_mib * 1024 * 1024);
+            if(mapped)
+                s.map_host(0, image, loadsize);
+            else
+                s.write_block(0, image, loadsize);
+        }
+        return true;
+    }
+
+    // Each segment of an "asm -s" image goes at its own address, a page at
+    // a time, and must lie entirely in RAM.  A Harvard program is the
+    // segment at address 0.
+    bool load_segments(uint8_t *image, size_t imagesize, bool mapped)
+    {
+        const segment::header *h = (const segment::header *)image;
+        const segment::entry *entries = (const segment::entry *)(h + 1);
+        if(h->count > (imagesize - sizeof(*h)) / sizeof(segment::entry))
+            return false;
+        if(options.harvard)
+            s.separate_instructions = true;
+
+        for(uint32_t i = 0; i < h->count; i++) {
+            const segment::entry& e = entries[i];
+            if(e.offset > imagesize || e.size > imagesize - e.offset || (e.address & page_mask) != 0)
+                return false;
+            uint8_t *data = image + e.offset;
+
+            if(options.harvard) {
+                if(e.address == 0) {
+                    s.program = (uint32_t *)data;
+                    s.programsize = e.size / 4;
+                }
+                continue;
+            }
+
+            if(uint64_t(e.address) + e.size > ((uint64_t)1 << 32))
+                return false;
+            for(uint64_t offset = 0; offset < e.size; offset += page_size)
+                if(s.read_page(e.address + offset) == NULL)
+                    return false;
+
+            for(uint64_t offset = 0; offset < e.size; offset += page_size) {
+                uint32_t addr = e.address + offset;
+                uint32_t n = std::min((uint64_t)page_size, e.size - offset);
+                if(mapped && n == page_size)
+                    s.map_host(addr, data + offset, page_size);
+                else
+                    s.write_block(addr, data + offset, n);
+            }
+        }
+        return true;
+    }
+
+    // Maps the disk image named in options at mmio::DISK_SECTOR
+    bool attach_disk()
+    {
+        disk.reset(new disk_device(s, mmio::DISK_SECTOR, interrupts, options.disk_latency));
+        if(!disk->open(options.disk_name.c_str()))
+            return false;
+        s.map_device(mmio::DISK_SECTOR & ~page_mask, page_size, disk.get());
+        return true;
+    }
+
+    // Starts the binary trace named in options from the current registers
+    bool start_trace()
+    {
+        tracer.reset(new trace_writer);
+        return tracer->open(options.trace_name.c_str(), options.trace_compress, s.registers);
+    }
+
+    // Profiles from the current PC if options ask for it
+    void start_profile()
+    {
+        if(!options.profile_name.empty() || !options.stacks_name.empty()) {
+            profile.reset(new profiler(s.registers[reg::PC]));
+            s.counts = &profile->counts;
+        }
+    }
+
+    // Sets up the timing model if options ask for it; false if a cache
+    // spec is bad
+    bool start_timing()
+    {
+        if(!options.timing)
+            return true;
+        timing.reset(new timing_model);
+        timing->memory_latency = options.memory_latency;
+        timing->branch_penalty = options.branch_penalty;
+        return timing->icache.configure(options.icache) && timing->dcache.configure(options.dcache);
+    }
+
+    // Writes the files options name; false if one couldn't be written
+    bool write_profile()
+    {
+        bool ok = true;
+        FILE *fp;
+        if(!options.profile_name.empty()) {
+            if((fp = fopen(options.profile_name.c_str(), "w")) != NULL) {
+                profile->write_report(fp, s, options.profile_top);
+                ok = (fclose(fp) == 0) && ok;
+            } else
+                ok = false;
+        }
+        if(!options.stacks_name.empty()) {
+            if((fp = fopen(options.stacks_name.c_str(), "w")) != NULL) {
+                profile->write_stacks(fp);
+                ok = (fclose(fp) == 0) && ok;
+            } else
+                ok = false;
+        }
+        return ok;
+    }
+
+    // Runs until halt, fault or the instruction limit, then flushes the
+    // console and writes out traces and profiles
+    void run()
+    {
+        execute();
+        finish();
+    }
+
+    // Runs until halt, fault, a breakpoint or the instruction limit; may be
+    // called again to carry on
+    void execute()
+    {
+        do
+            run_engines();
+        while(!s.halted && (s.memory_fault ? s.take_exception() : s.run_events()));
+    }
+
+    // Runs until halt, fault, a breakpoint or the next event is due
+    void run_engines()
+    {
+        int verbosity = options.verbosity;
+        bool stepping = options.stepping();
+
+        if(options.use_jit && !stepping) {
+#if defined(__x86_64__)
+            if(translator.buffer != NULL || translator.init())
+                translator.run(s);
+            else
+                fprintf(stderr, "couldn't map JIT code buffer, interpreting\n");
+#else
+            fprintf(stderr, "JIT is only available on x86-64, interpreting\n");
+#endif
+        }
+
+        if(options.threaded && !s.halted && !s.memory_fault && !stepping)
+            run_threaded(s);
+
+        while(!s.halted && !s.memory_fault && s.instructions < s.instruction_limit) {
+            uint32_t pc = s.registers[reg::PC];
+            const decoded_instruction& d = s.decode(pc);
+            const instruction& instr = d.instr;
+
+            if(s.memory_fault)
+                break;
+
+            if(verbosity >= VerbosityLevel::DEBUG) {
+                printf("decoded %s", opcodes[instr.opcode].name);
+                if(opcodes[instr.opcode].datasize == 18) {
+                    printf(", dst = %d, src = %d, size = %d, data = 0x%X\n", instr.dst, instr.src, instr.modifier, instr.data);
+                } else if(opcodes[instr.opcode].datasize == 24) {
+                    printf(", dst = %d, src = %d, data = 0x%X\n", instr.dst, instr.src, instr.data);
+                } else /* if(opcodes[instr.opcode].datasize == 27) or 6 */ {
+                    printf(", dst = %d, data = 0x%X\n", instr.dst, instr.data);
+                }
+            }
+
+            if(timing)
+                timing->before(s, pc, instr);
+
+            unsigned long long before = s.instructions;
+            uint second = d.fused ? d.second.opcode : 0;
+            memory_changed change = s.use_fused(d) ? d.fused(s, d) : d.func(s, instr);
+            if(!s.memory_fault)
+                s.instructions++;
+            if(s.counts)
+                s.counts->add(pc, instr.opcode, second, s.instructions - before);
+            if(s.memory_fault)
+                break;
+
+            if(timing)
+                timing->after(pc, instr, s.registers[reg::PC]);
+            if(tracer)
+                tracer->record(s, pc, change);
+            if(profile && stepping)
+                profile->executed(pc, instr, s.registers[reg::PC]);
+
+            if(verbosity >= VerbosityLevel::DEBUG) {
+                printf("R0:%08X R1:%08X R2:%08X R3:%08X\n",
+                    s.registers[0], s.registers[1], s.registers[2], s.registers[3]);
+                printf("R4:%08X R5:%08X SP:%08X PC:%08X\n", 
+                    s.registers[4], s.registers[5], s.registers[6], s.registers[7]);
+
+                // hack not to trigger memory fault
+                if(change.first && s.is_ram(change.second, 4)) {
+                    printf("memory changed %08x : %08X\n", change.second, s.fetch32(change.second));
+                }
+            }
+        };
+    }
+
+    void finish()
+    {
+        console.flush();
+        if(tracer && !tracer->close())
+            fprintf(stderr, "couldn't write all of trace %s\n", options.trace_name.c_str());
+        if(profile && !write_profile())
+            fprintf(stderr, "couldn't write profile: %s\n", strerror(errno));
+    }
+
+    bool save(const char *filename)
+    {
+        console.flush();
+        snapshot snap;
+        s.take_snapshot(snap);
+        return write_snapshot(snap, filename);
+    }
+
+    static const char *fault_names[];
+
+    const char *halt_reason() const
+    {
+        if(s.memory_fault)
+            return "fault";
+        if(s.halted)
+            return "halt";
+        return "limit";
+    }
+
+    void print_report()
+    {
+        if(s.memory_fault)
+            printf("%s at 0x%08X\n", fault_names[s.fault_vector / 4], s.fault_address);
+        else if(!s.halted)
+            printf("instruction limit reached\n");
+
+        if(options.verbosity >= VerbosityLevel::INFO) {
+            printf("R0:%08X R1:%08X R2:%08X R3:%08X\n",
+                s.registers[0], s.registers[1], s.registers[2], s.registers[3]);
+            printf("R4:%08X R5:%08X SP:%08X PC:%08X\n", 
+                s.registers[4], s.registers[5], s.registers[6], s.registers[7]);
+            printf("%llu instructions executed\n", s.instructions);
+            printf("%zu KiB of guest RAM allocated\n", s.allocated_pages * page_size / 1024);
+            for(int i = 0; i < fusion_kinds; i++)
+                if(s.fusion_counts[i] > 0)
+                    printf("%llu %s fused\n", s.fusion_counts[i], fusions[i].name);
+        }
+
+        if(timing)
+            timing->report(stdout);
+    }
+};
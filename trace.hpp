@@ -0,0 +1,263 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+// Binary execution traces written by "sim --trace" and read by simtrace.
+// Include simple_cpu_2014.hpp first.
+//
+// A trace_header is followed by chunks, each a trace_chunk and its bytes,
+// zlib-compressed if the header says so.  A chunk holds whole records, one
+// per instruction, each relative to the one before:
+//
+//   flags byte
+//   TRACE_JUMP: zigzag varint of PC minus the previous PC + 4
+//   TRACE_REGISTERS: byte mask of R0..SP changed, then for each a zigzag
+//       varint of the new value minus the old
+//   TRACE_STORE: zigzag varint of the address minus the previous store's,
+//       then if TRACE_STORE_VALUE a varint of the 32-bit word now there
+//
+// Before the first record the previous PC is taken to be
+// header.registers[PC] - 4.
+
+namespace trace {
+
+const char magic[8] = {'S', 'C', 'P', 'U', 'T', 'R', 'C', '1'};
+
+const uint32_t COMPRESSED = 0x1; // trace_header::flags
+
+const uint8_t TRACE_JUMP = 0x01;
+const uint8_t TRACE_REGISTERS = 0x02;
+const uint8_t TRACE_STORE = 0x04;
+const uint8_t TRACE_STORE_VALUE = 0x08; // stores to devices have no value
+
+const int register_count = 8;
+const uint32_t chunk_size = 1024 * 1024; // raw bytes per chunk, at most
+const uint32_t max_record = 1 + 5 + 1 + (register_count - 1) * 5 + 5 + 5;
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t registers[register_count]; // when tracing started
+};
+
+struct trace_chunk
+{
+    uint32_t size; // decoded bytes
+    uint32_t stored; // bytes that follow in the file
+};
+
+inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+inline int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+inline uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// NULL if the varint runs past end
+inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t value = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+        if(p == end)
+            return NULL;
+        uint8_t b = *p++;
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            break;
+    }
+    *v = value;
+    return p;
+}
+
+// Writes records into a chunk; the caller ships it when full() says so
+struct encoder
+{
+    std::vector<uint8_t> chunk;
+    uint32_t used;
+    int32_t last[register_count];
+    uint32_t next_pc;
+    uint32_t last_store;
+
+    encoder(const int32_t *initial) : chunk(chunk_size), used(0), last_store(0)
+    {
+        memcpy(last, initial, sizeof(last));
+        next_pc = initial[simple_cpu_2014::reg::PC];
+    }
+
+    bool full() const { return used > chunk_size - max_record; }
+
+    // One instruction at pc that left the given registers, and stored to
+    // store_address if stored (store_value is valid if has_value)
+    void record(uint32_t pc, const int32_t *after, bool stored, uint32_t store_address, bool has_value, uint32_t store_value)
+    {
+        uint8_t *p = &chunk[used];
+        uint8_t *flags = p++;
+        *flags = 0;
+
+        if(pc != next_pc) {
+            *flags |= TRACE_JUMP;
+            p = put_varint(p, zigzag(pc - next_pc));
+        }
+        next_pc = pc + 4;
+
+        uint8_t mask = 0;
+        for(uint r = 0; r < simple_cpu_2014::reg::PC; r++)
+            if(after[r] != last[r])
+                mask |= 1 << r;
+        if(mask != 0) {
+            *flags |= TRACE_REGISTERS;
+            *p++ = mask;
+            for(uint r = 0; r < simple_cpu_2014::reg::PC; r++)
+                if(mask & (1 << r)) {
+                    p = put_varint(p, zigzag((uint32_t)after[r] - (uint32_t)last[r]));
+                    last[r] = after[r];
+                }
+        }
+
+        if(stored) {
+            *flags |= TRACE_STORE;
+            p = put_varint(p, zigzag(store_address - last_store));
+            last_store = store_address;
+            if(has_value) {
+                *flags |= TRACE_STORE_VALUE;
+                p = put_varint(p, store_value);
+            }
+        }
+        used = p - &chunk[0];
+    }
+};
+
+struct record
+{
+    unsigned long long index; // instructions before this one in the trace
+    uint32_t pc;
+    uint8_t written; // mask of R0..SP this instruction changed
+    int32_t registers[register_count]; // R0..SP after it; PC is this one's
+    bool stored;
+    uint32_t store_address;
+    bool has_value;
+    uint32_t store_value;
+};
+
+// Streams records from a trace file one chunk at a time
+struct reader
+{
+    FILE *fp;
+    trace_header header;
+    std::vector<uint8_t> stored;
+    std::vector<uint8_t> chunk;
+    size_t pos;
+    record current;
+    const char *error;
+
+    reader() : fp(NULL), pos(0), error(NULL) {}
+    ~reader() { if(fp != NULL) fclose(fp); }
+
+    bool open(const char *filename)
+    {
+        fp = fopen(filename, "rb");
+        if(fp == NULL)
+            return false;
+        if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, magic, sizeof(magic)) != 0) {
+            error = "not a trace file";
+            return false;
+        }
+        memset(&current, 0, sizeof(current));
+        memcpy(current.registers, header.registers, sizeof(current.registers));
+        current.pc = header.registers[simple_cpu_2014::reg::PC] - 4;
+        current.index = ~0ULL; // the first record is index 0
+        return true;
+    }
+
+    bool read_chunk()
+    {
+        trace_chunk c;
+        if(fread(&c, sizeof(c), 1, fp) != 1)
+            return false;
+        chunk.resize(c.size);
+        pos = 0;
+        if(!(header.flags & COMPRESSED)) {
+            if(c.stored != c.size || fread(&chunk[0], c.size, 1, fp) != 1) {
+                error = "trace file is truncated";
+                return false;
+            }
+            return true;
+        }
+        stored.resize(c.stored);
+        uLongf size = c.size;
+        if(fread(&stored[0], c.stored, 1, fp) != 1 ||
+            uncompress(&chunk[0], &size, &stored[0], c.stored) != Z_OK || size != c.size) {
+            error = "trace file is corrupt";
+            return false;
+        }
+        return true;
+    }
+
+    // Advances to the next record; false at the end or on an error
+    bool next()
+    {
+        while(pos >= chunk.size())
+            if(!read_chunk())
+                return false;
+
+        const uint8_t *p = &chunk[pos];
+        const uint8_t *end = &chunk[0] + chunk.size();
+        uint8_t flags = *p++;
+        uint32_t v;
+
+        current.index++;
+        current.pc += 4;
+        if(flags & TRACE_JUMP) {
+            if((p = get_varint(p, end, &v)) == NULL)
+                return corrupt();
+            current.pc += unzigzag(v);
+        }
+        current.registers[simple_cpu_2014::reg::PC] = current.pc;
+
+        current.written = 0;
+        if(flags & TRACE_REGISTERS) {
+            if(p == end)
+                return corrupt();
+            current.written = *p++;
+            for(uint r = 0; r < simple_cpu_2014::reg::PC; r++)
+                if(current.written & (1 << r)) {
+                    if((p = get_varint(p, end, &v)) == NULL)
+                        return corrupt();
+                    current.registers[r] = (uint32_t)current.registers[r] + unzigzag(v);
+                }
+        }
+
+        current.stored = flags & TRACE_STORE;
+        current.has_value = false;
+        if(current.stored) {
+            if((p = get_varint(p, end, &v)) == NULL)
+                return corrupt();
+            current.store_address += unzigzag(v);
+            if(flags & TRACE_STORE_VALUE) {
+                current.has_value = true;
+                if((p = get_varint(p, end, &current.store_value)) == NULL)
+                    return corrupt();
+            }
+        }
+
+        pos = p - &chunk[0];
+        return true;
+    }
+
+    // A record that runs past the end of its chunk
+    bool corrupt()
+    {
+        error = "trace file is corrupt";
+        return false;
+    }
+};
+
+};
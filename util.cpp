@@ -5,7 +5,9 @@ void write_vectors(memory& m, uint32_t reset)
 {
     using namespace simple_cpu_2014;
 
-    m.w(0, JMP(reset));
-    // XXX interrupt vectors, also
+    m.w(vectors::RESET, JMP(reset));
+    // no handlers; an exception or interrupt stops the program
+    for(uint32_t v = vectors::ILLEGAL; v <= vectors::INTERRUPT; v += 4)
+        m.w(v, HALT(0));
 }
 